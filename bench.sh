@@ -0,0 +1,137 @@
+#!/bin/bash
+#
+# bench.sh -- PS3Utils performance benchmark
+#
+# Copyright (C) Youness Alaoui (KaKaRoTo)
+#
+# This software is distributed under the terms of the GNU General Public
+# License ("GPL") version 3, as published by the Free Software Foundation.
+#
+# Generates a synthetic PUP with 'pup c' and times the hashing and I/O
+# paths. Every result is printed on stdout as one tab separated line:
+#   name  bytes  seconds  MB/s  sha1-implementation
+# Runs are warm cache, compare results from the same machine only.
+#
+# Configuration (environment):
+#   BENCH_SIZE_MB   Total size of the synthetic PUP entries (default 256)
+#   BENCH_ENTRIES   Number of PUP entries, 1 to 10 (default 10)
+#   BENCH_JOBS      Worker count for the -j runs (default: online CPUs)
+#   BENCH_DIR       Scratch directory (default: a new temporary directory)
+#
+
+BUILDDIR=$(cd $(dirname $0) && pwd)
+PUP="$BUILDDIR/pup"
+FIX_TAR="$BUILDDIR/fix_tar"
+FIND_SYSCALL="$BUILDDIR/find_syscall"
+FIND_PATTERN="$BUILDDIR/find_pattern"
+SHA1_BENCH="$BUILDDIR/sha1_bench"
+
+SIZE_MB=${BENCH_SIZE_MB:-256}
+ENTRIES=${BENCH_ENTRIES:-10}
+JOBS=${BENCH_JOBS:-$(getconf _NPROCESSORS_ONLN)}
+WORKDIR=${BENCH_DIR:-$(mktemp -d)}
+
+# Same order as the entries[] table in pup.c
+FILES="version.txt license.xml promo_flags.txt update_flags.txt patch_build.txt
+ps3swu.self vsh.tar dots.txt patch_data.pkg update_files.tar"
+
+die()
+{
+    echo "$@" >&2
+    exit 1
+}
+
+# run <name> <bytes> <command...>
+run()
+{
+    local name=$1
+    local bytes=$2
+    local start end
+    shift 2
+
+    start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1 || die "Benchmark $name failed: $*"
+    end=$(date +%s.%N)
+    awk -v n="$name" -v b="$bytes" -v s="$start" -v e="$end" \
+        -v impl="$IMPLEMENTATION" 'BEGIN {
+        t = e - s;
+        rate = 0;
+        if (t > 0)
+            rate = b / t / 1048576;
+        printf "%s\t%d\t%.6f\t%.1f\t%s\n", n, b, t, rate, impl
+    }'
+}
+
+if [ "$ENTRIES" -lt 1 -o "$ENTRIES" -gt 10 ]; then
+    die "BENCH_ENTRIES must be between 1 and 10"
+fi
+for bin in "$PUP" "$FIX_TAR" "$FIND_SYSCALL" "$FIND_PATTERN" "$SHA1_BENCH"; do
+    [ -x "$bin" ] || die "$bin is missing, run make first"
+done
+
+mkdir -p "$WORKDIR/in" || die "Could not create $WORKDIR"
+cd "$WORKDIR"
+rm -rf in/* out out_j out_u test.pup test_c.pup test_u.pup test.tar dump.bin boundary.bin
+
+echo -e "# name\tbytes\tseconds\tMB/s\tsha1"
+
+"$SHA1_BENCH" $SIZE_MB || die "sha1_bench failed"
+PS3UTILS_SHA1=generic "$SHA1_BENCH" $SIZE_MB || die "sha1_bench failed"
+
+# Synthetic entries: the size is split evenly between the first
+# $ENTRIES files of the entries table
+ENTRY_KB=$((SIZE_MB * 1024 / ENTRIES))
+for f in $(echo $FILES | cut -d ' ' -f 1-$ENTRIES); do
+    head -c ${ENTRY_KB}K /dev/urandom > in/$f || die "Could not create in/$f"
+done
+BYTES=$(cat in/* | wc -c)
+
+for IMPLEMENTATION in native generic; do
+    if [ "$IMPLEMENTATION" == "generic" ]; then
+        export PS3UTILS_SHA1=generic
+    fi
+
+    rm -rf test.pup out out_j
+    run pup_c $BYTES "$PUP" c in test.pup 1
+    run pup_i $(stat -c %s test.pup) "$PUP" i test.pup
+    run pup_v $BYTES "$PUP" v test.pup
+    run pup_v_j$JOBS $BYTES "$PUP" v -j $JOBS test.pup
+    run pup_x $BYTES "$PUP" x test.pup out
+    run pup_x_j$JOBS $BYTES "$PUP" x -j $JOBS test.pup out_j
+
+    # Same copies with reads, hashing and writes overlapped by io_uring,
+    # these fall back to the runs above if the kernel doesn't have it
+    rm -rf test_u.pup out_u
+    PS3UTILS_IO=uring run pup_c_uring $BYTES "$PUP" c in test_u.pup 1
+    PS3UTILS_IO=uring run pup_x_uring $BYTES "$PUP" x test_u.pup out_u
+done
+unset PS3UTILS_SHA1
+IMPLEMENTATION=-
+
+tar -H ustar -cf test.tar -C in . || die "Could not create test.tar"
+run fix_tar $(stat -c %s test.tar) "$FIX_TAR" test.tar
+
+head -c ${SIZE_MB}M /dev/urandom > dump.bin || die "Could not create dump.bin"
+run find_syscall_j1 $(stat -c %s dump.bin) "$FIND_SYSCALL" -j 1 dump.bin
+run find_syscall_j$JOBS $(stat -c %s dump.bin) "$FIND_SYSCALL" -j $JOBS dump.bin
+
+# The PUP magic is always found, the other patterns usually aren't
+for j in 1 $JOBS; do
+    run find_pattern_j$j $(stat -c %s test.pup) "$FIND_PATTERN" -j $j \
+        -x 5343455546 -e category_game_tool2.xml -e ps3swu.self test.pup
+done
+
+# Threads scan in 16MB chunks, a match that straddles two of them must
+# still be found
+head -c 20M /dev/zero > boundary.bin || die "Could not create boundary.bin"
+printf "category_game_tool2.xml" | \
+    dd of=boundary.bin bs=1 seek=$((16 * 1024 * 1024 - 3)) conv=notrunc \
+    2> /dev/null || die "Could not create boundary.bin"
+[ "$("$FIND_PATTERN" -j $JOBS -e category_game_tool2.xml boundary.bin)" == \
+    "boundary.bin:0xFFFFFD:category_game_tool2.xml" ] || \
+    die "find_pattern missed a match across a chunk boundary"
+
+if [ "x$BENCH_DIR" == "x" ]; then
+    cd "$BUILDDIR"
+    rm -rf "$WORKDIR"
+fi
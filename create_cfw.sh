@@ -11,6 +11,7 @@
 BUILDDIR=`pwd`
 PUP="$BUILDDIR/pup"
 FIX_TAR="$BUILDDIR/fix_tar"
+FIND_PATTERN="$BUILDDIR/find_pattern"
 FWPKG="$BUILDDIR/../fwtool/fwpkg"
 LOGFILE="$BUILDDIR/create_cfw.log"
 OUTDIR="$BUILDDIR/CFW"
@@ -75,7 +76,7 @@ for f in ../dev_flash*tar*; do
 done
 
 log "Searching for category_game_tool2.xml in dev_flash"
-TAR_FILE=$(grep -l "category_game_tool2.xml" *.tar)
+TAR_FILE=$($FIND_PATTERN -l "category_game_tool2.xml" *.tar)
 if [ "x$TAR_FILE" == "x" ]; then
     die "Could not find category_game_tool2.xml"
 fi
@@ -0,0 +1,726 @@
+/*
+ * find_pattern.c -- Multiple pattern search in files, PUPs and archives
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+/* For nftw () */
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libpup.h"
+#include "tar.h"
+
+/* All the patterns are compiled in a single Aho-Corasick automaton, stored
+ * as a complete transition table so every input byte costs one lookup.
+ * The table takes 1KB per state, which is one state per pattern byte. */
+#define MAX_STATES (256 * 1024)
+#define MATCH_FLAG 0x80000000
+#define STATE_MASK (MATCH_FLAG - 1)
+
+/* Files are mapped and scanned this many at a time, in chunks of
+ * CHUNK_SIZE bytes that are shared between the threads */
+#define BATCH_SIZE 64
+#define CHUNK_SIZE (16 * 1024 * 1024)
+
+/* How deep -d goes in archives stored in archives */
+#define MAX_DEPTH 4
+
+typedef struct {
+  uint8_t *bytes;
+  size_t len;
+  char *text;
+  /* Next pattern that ends in the same state, or -1 */
+  int next;
+} Pattern;
+
+typedef struct {
+  uint64_t offset;
+  int pattern;
+} Match;
+
+/* Something to scan: a file, a PUP entry or an archive member */
+typedef struct {
+  char *name;
+  const uint8_t *data;
+  uint64_t size;
+} Item;
+
+typedef struct {
+  unsigned int item;
+  uint64_t start;
+  uint64_t end;
+  Match *matches;
+  unsigned int count;
+  unsigned int allocated;
+} Unit;
+
+typedef struct {
+  void *map;
+  size_t size;
+  PUPFile *pup;
+} Input;
+
+static Pattern *patterns = NULL;
+static unsigned int pattern_count = 0;
+static size_t max_pattern_len = 0;
+
+static uint32_t *transitions = NULL;
+/* First pattern ending in a state, or -1 */
+static int *state_pattern = NULL;
+/* Longest proper suffix of a state that some pattern ends in, 0 if none */
+static uint32_t *state_suffix = NULL;
+static unsigned int state_count = 0;
+
+static Item *items = NULL;
+static unsigned int item_count = 0;
+static Unit *units = NULL;
+static unsigned int unit_count = 0;
+static Input inputs[BATCH_SIZE];
+static unsigned int input_count = 0;
+
+static char **paths = NULL;
+static unsigned int path_count = 0;
+
+static int list_only = 0;
+static int descend = 0;
+static int errors = 0;
+
+static void *grow (void *array, unsigned int count, size_t size)
+{
+  void *ret;
+
+  /* Arrays grow by doubling, count is the number of used elements */
+  if (count & (count - 1))
+    return array;
+  ret = realloc (array, (count ? count * 2 : 1) * size);
+  if (ret == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit (-2);
+  }
+  return ret;
+}
+
+static int parse_hex (const char *hex, uint8_t *bytes, size_t *len)
+{
+  int nibble;
+  int high = -1;
+
+  *len = 0;
+  for (; *hex; hex++) {
+    if (*hex == ' ' || *hex == '\t' || *hex == ':')
+      continue;
+    if (*hex >= '0' && *hex <= '9')
+      nibble = *hex - '0';
+    else if (*hex >= 'a' && *hex <= 'f')
+      nibble = *hex - 'a' + 10;
+    else if (*hex >= 'A' && *hex <= 'F')
+      nibble = *hex - 'A' + 10;
+    else
+      return 0;
+
+    if (high < 0) {
+      high = nibble;
+    } else {
+      bytes[(*len)++] = (high << 4) | nibble;
+      high = -1;
+    }
+  }
+
+  return high < 0;
+}
+
+/* Hex patterns are printed as they were given, prefixed with "hex:" */
+static int add_pattern (const char *pattern, int hex)
+{
+  Pattern *p;
+
+  patterns = grow (patterns, pattern_count, sizeof(Pattern));
+  p = &patterns[pattern_count];
+
+  p->bytes = malloc (strlen (pattern) + 1);
+  p->text = malloc (strlen (pattern) + 5);
+  if (p->bytes == NULL || p->text == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit (-2);
+  }
+
+  if (hex) {
+    if (!parse_hex (pattern, p->bytes, &p->len)) {
+      fprintf (stderr, "Invalid hex pattern '%s'\n", pattern);
+      goto error;
+    }
+    sprintf (p->text, "hex:%s", pattern);
+  } else {
+    p->len = strlen (pattern);
+    memcpy (p->bytes, pattern, p->len);
+    strcpy (p->text, pattern);
+  }
+  if (p->len == 0) {
+    fprintf (stderr, "Empty patterns are not allowed\n");
+    goto error;
+  }
+
+  if (p->len > max_pattern_len)
+    max_pattern_len = p->len;
+  pattern_count++;
+
+  return 1;
+
+ error:
+  free (p->bytes);
+  free (p->text);
+  return 0;
+}
+
+/* One pattern per line, lines starting with "hex:" are hex patterns */
+static int load_patterns (const char *path)
+{
+  FILE *fd;
+  char *line = NULL;
+  size_t allocated = 0;
+  ssize_t len;
+  int ret = 1;
+
+  fd = strcmp (path, "-") == 0 ? stdin : fopen (path, "r");
+  if (fd == NULL) {
+    perror ("Could not open pattern file ");
+    return 0;
+  }
+
+  while (ret && (len = getline (&line, &allocated, fd)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len > 0 && line[len - 1] == '\r')
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    if (strncmp (line, "hex:", 4) == 0)
+      ret = add_pattern (line + 4, 1);
+    else
+      ret = add_pattern (line, 0);
+  }
+
+  free (line);
+  if (fd != stdin)
+    fclose (fd);
+
+  return ret;
+}
+
+static int build_automaton (void)
+{
+  uint32_t *fail = NULL;
+  uint32_t *queue = NULL;
+  size_t total = 1;
+  unsigned int head = 0;
+  unsigned int tail = 0;
+  unsigned int state;
+  unsigned int next;
+  unsigned int i;
+  size_t j;
+  int b;
+
+  for (i = 0; i < pattern_count; i++)
+    total += patterns[i].len;
+  if (total > MAX_STATES) {
+    fprintf (stderr, "Too many patterns, they can't be longer than %d "
+        "bytes in total\n", MAX_STATES - 1);
+    return 0;
+  }
+
+  transitions = calloc (total * 256, sizeof(uint32_t));
+  state_pattern = malloc (total * sizeof(int));
+  state_suffix = calloc (total, sizeof(uint32_t));
+  fail = calloc (total, sizeof(uint32_t));
+  queue = malloc (total * sizeof(uint32_t));
+  if (transitions == NULL || state_pattern == NULL || state_suffix == NULL ||
+      fail == NULL || queue == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    goto error;
+  }
+  for (j = 0; j < total; j++)
+    state_pattern[j] = -1;
+
+  /* The trie, duplicate patterns end in the same state */
+  state_count = 1;
+  for (i = 0; i < pattern_count; i++) {
+    state = 0;
+    for (j = 0; j < patterns[i].len; j++) {
+      next = transitions[state * 256 + patterns[i].bytes[j]];
+      if (next == 0) {
+        next = state_count++;
+        transitions[state * 256 + patterns[i].bytes[j]] = next;
+      }
+      state = next;
+    }
+    patterns[i].next = state_pattern[state];
+    state_pattern[state] = i;
+  }
+
+  /* Failure links in breadth first order, so the failure state of every
+   * state is complete by the time it's used to fill in the missing
+   * transitions */
+  for (b = 0; b < 256; b++) {
+    if (transitions[b])
+      queue[tail++] = transitions[b];
+  }
+  while (head < tail) {
+    state = queue[head++];
+    for (b = 0; b < 256; b++) {
+      next = transitions[state * 256 + b];
+      if (next == 0) {
+        transitions[state * 256 + b] = transitions[fail[state] * 256 + b];
+        continue;
+      }
+      fail[next] = transitions[fail[state] * 256 + b];
+      state_suffix[next] = state_pattern[fail[next]] >= 0 ?
+          fail[next] : state_suffix[fail[next]];
+      queue[tail++] = next;
+    }
+  }
+
+  /* Flag the transitions that lead to a match, so the scan loop only needs
+   * to look at the state it just got */
+  for (j = 0; j < (size_t) state_count * 256; j++) {
+    next = transitions[j];
+    if (state_pattern[next] >= 0 || state_suffix[next] != 0)
+      transitions[j] |= MATCH_FLAG;
+  }
+
+  free (fail);
+  free (queue);
+
+  return 1;
+
+ error:
+  free (fail);
+  free (queue);
+  return 0;
+}
+
+static void add_match (Unit *unit, uint64_t offset, int pattern)
+{
+  Match *matches;
+
+  if (unit->count == unit->allocated) {
+    unit->allocated = unit->allocated ? unit->allocated * 2 : 16;
+    matches = realloc (unit->matches, unit->allocated * sizeof(Match));
+    if (matches == NULL) {
+      fprintf (stderr, "Out of memory\n");
+      exit (-2);
+    }
+    unit->matches = matches;
+  }
+  unit->matches[unit->count].offset = offset;
+  unit->matches[unit->count].pattern = pattern;
+  unit->count++;
+}
+
+static int compare_matches (const void *a, const void *b)
+{
+  const Match *match_a = a;
+  const Match *match_b = b;
+
+  if (match_a->offset != match_b->offset)
+    return match_a->offset < match_b->offset ? -1 : 1;
+  return match_a->pattern - match_b->pattern;
+}
+
+/* A unit reads past its end far enough to finish the patterns that begin
+ * before it, and only reports those that begin in its own range, so
+ * nothing is missed or found twice where two units meet */
+static void scan_unit (void *data, unsigned int index)
+{
+  Unit *unit = &units[index];
+  const uint8_t *bytes = items[unit->item].data;
+  uint64_t size = items[unit->item].size;
+  uint64_t end = size - unit->end > max_pattern_len - 1 ?
+      unit->end + (max_pattern_len - 1) : size;
+  uint64_t offset;
+  uint64_t i;
+  uint32_t state = 0;
+  uint32_t match;
+  int p;
+
+  for (i = unit->start; i < end; i++) {
+    state = transitions[(state & STATE_MASK) * 256 + bytes[i]];
+    if (!(state & MATCH_FLAG))
+      continue;
+
+    match = state & STATE_MASK;
+    if (state_pattern[match] < 0)
+      match = state_suffix[match];
+    for (; match; match = state_suffix[match]) {
+      for (p = state_pattern[match]; p >= 0; p = patterns[p].next) {
+        offset = i + 1 - patterns[p].len;
+        if (offset < unit->end)
+          add_match (unit, offset, p);
+      }
+    }
+    if (list_only && unit->count > 0)
+      break;
+  }
+
+  if (unit->count > 1)
+    qsort (unit->matches, unit->count, sizeof(Match), compare_matches);
+}
+
+static int is_tar (const uint8_t *data, uint64_t size)
+{
+  const TARHeader *header = (const TARHeader *) data;
+  TARMember member;
+
+  return size >= TAR_BLOCK_SIZE &&
+      memcmp (header->ustar, "ustar", 5) == 0 &&
+      tar_parse_header (data, &member) == 1;
+}
+
+static void add_item (const char *name, const uint8_t *data, uint64_t size,
+    unsigned int depth)
+{
+  TARReader reader;
+  TARMember member;
+  char *member_name;
+  int ret;
+
+  if (descend && depth < MAX_DEPTH && is_tar (data, size)) {
+    tar_reader_init (&reader, data, size);
+    while ((ret = tar_reader_next (&reader, &member)) == 1) {
+      if (member.type == '5')
+        continue;
+      member_name = malloc (strlen (name) + strlen (member.name) + 2);
+      if (member_name == NULL) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-2);
+      }
+      sprintf (member_name, "%s:%s", name, member.name);
+      add_item (member_name, member.data, member.size, depth + 1);
+      free (member_name);
+    }
+    if (ret < 0) {
+      fprintf (stderr, "%s: truncated or corrupted tar archive\n", name);
+      errors++;
+    }
+    return;
+  }
+
+  if (size == 0)
+    return;
+
+  items = grow (items, item_count, sizeof(Item));
+  items[item_count].name = strdup (name);
+  if (items[item_count].name == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit (-2);
+  }
+  items[item_count].data = data;
+  items[item_count].size = size;
+  item_count++;
+}
+
+static void add_pup (const char *path)
+{
+  const PUPHeader *header;
+  const PUPFileEntry *files;
+  const uint8_t *data;
+  const char *filename;
+  PUPFile *pup = NULL;
+  char *name;
+  unsigned int i;
+  int ret;
+
+  ret = pup_open (path, &pup);
+  if (ret != PUP_OK && ret != PUP_ERROR_HEADER_HASH) {
+    fprintf (stderr, "%s: %s\n", path, pup_strerror (ret));
+    errors++;
+    pup_close (pup);
+    return;
+  }
+  inputs[input_count++].pup = pup;
+
+  header = pup_get_header (pup);
+  files = pup_get_files (pup);
+  name = malloc (strlen (path) + 32);
+  if (name == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit (-2);
+  }
+
+  for (i = 0; i < header->file_count; i++) {
+    ret = pup_entry_data (pup, i, &data);
+    if (ret != PUP_OK) {
+      fprintf (stderr, "%s: entry %d: %s\n", path, i, pup_strerror (ret));
+      errors++;
+      continue;
+    }
+
+    /* Unknown entries are named after their id, like 'pup x' does */
+    filename = pup_id_to_filename (files[i].entry_id);
+    if (filename)
+      sprintf (name, "%s:%s", path, filename);
+    else
+      sprintf (name, "%s:0x%X", path, (uint32_t) files[i].entry_id);
+    add_item (name, data, files[i].data_length, 1);
+  }
+
+  free (name);
+}
+
+static void add_file (const char *path)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    errors++;
+    return;
+  }
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+    fprintf (stderr, "%s: not a regular file\n", path);
+    errors++;
+    close (fd);
+    return;
+  }
+  if (st.st_size == 0) {
+    close (fd);
+    return;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    errors++;
+    return;
+  }
+
+  /* PUPs go through libpup for their entry table, which maps them again */
+  if (descend && st.st_size >= (off_t) sizeof(PUPHeader) &&
+      memcmp (map, "SCEUF", 5) == 0) {
+    munmap (map, st.st_size);
+    add_pup (path);
+    return;
+  }
+
+  posix_madvise (map, st.st_size, POSIX_MADV_SEQUENTIAL);
+  inputs[input_count].map = map;
+  inputs[input_count].size = st.st_size;
+  input_count++;
+  add_item (path, map, st.st_size, 0);
+}
+
+static int collect_path (const char *path, const struct stat *stat_buf,
+    int type, struct FTW *ftw)
+{
+  if (type != FTW_F || !S_ISREG (stat_buf->st_mode))
+    return 0;
+
+  paths = grow (paths, path_count, sizeof(char *));
+  paths[path_count] = strdup (path);
+  if (paths[path_count] == NULL)
+    return -1;
+  path_count++;
+
+  return 0;
+}
+
+static int compare_paths (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+static void add_path (const char *path)
+{
+  struct stat st;
+  unsigned int first = path_count;
+
+  if (stat (path, &st) == 0 && S_ISDIR (st.st_mode)) {
+    /* Directories are searched recursively, in a stable order */
+    if (nftw (path, collect_path, 64, FTW_PHYS) != 0) {
+      fprintf (stderr, "%s: could not walk the directory\n", path);
+      errors++;
+    }
+    qsort (paths + first, path_count - first, sizeof(char *), compare_paths);
+    return;
+  }
+
+  paths = grow (paths, path_count, sizeof(char *));
+  paths[path_count] = strdup (path);
+  if (paths[path_count] == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit (-2);
+  }
+  path_count++;
+}
+
+/* Scans the items and prints the results in order, returns the number of
+ * matches */
+static uint64_t scan_items (unsigned int jobs)
+{
+  uint64_t found = 0;
+  uint64_t offset;
+  unsigned int i;
+  unsigned int j;
+  int printed = -1;
+
+  unit_count = 0;
+  for (i = 0; i < item_count; i++) {
+    for (offset = 0; offset < items[i].size; offset += CHUNK_SIZE) {
+      units = grow (units, unit_count, sizeof(Unit));
+      memset (&units[unit_count], 0, sizeof(Unit));
+      units[unit_count].item = i;
+      units[unit_count].start = offset;
+      units[unit_count].end = items[i].size - offset > CHUNK_SIZE ?
+          offset + CHUNK_SIZE : items[i].size;
+      unit_count++;
+    }
+  }
+
+  pup_run_parallel (unit_count, jobs, scan_unit, NULL);
+
+  for (i = 0; i < unit_count; i++) {
+    for (j = 0; j < units[i].count; j++) {
+      if (!list_only)
+        printf ("%s:0x%llX:%s\n", items[units[i].item].name,
+            (unsigned long long) units[i].matches[j].offset,
+            patterns[units[i].matches[j].pattern].text);
+      else if (printed != (int) units[i].item)
+        printf ("%s\n", items[units[i].item].name);
+      printed = units[i].item;
+    }
+    found += units[i].count;
+    free (units[i].matches);
+  }
+
+  return found;
+}
+
+static void release_inputs (void)
+{
+  unsigned int i;
+
+  for (i = 0; i < item_count; i++)
+    free (items[i].name);
+  item_count = 0;
+
+  for (i = 0; i < input_count; i++) {
+    if (inputs[i].pup)
+      pup_close (inputs[i].pup);
+    else
+      munmap (inputs[i].map, inputs[i].size);
+  }
+  memset (inputs, 0, sizeof(inputs));
+  input_count = 0;
+}
+
+static void usage (const char *program)
+{
+  printf ("Usage : %s [options] [pattern] <file|directory>...\n"
+      "Searches files for any number of patterns at once, directories are\n"
+      "searched recursively. Every match is printed as name:offset:pattern.\n"
+      "\n"
+      "Options :\n"
+      "\t-e <string>\tsearch for a string\n"
+      "\t-x <hex>\tsearch for hex bytes, such as \"53 43 45 55 46\"\n"
+      "\t-f <file>\tread patterns from a file, one per line, lines\n"
+      "\t\t\tstarting with 'hex:' are hex bytes\n"
+      "\t-d\t\tsearch the entries of PUP files and the members of tar\n"
+      "\t\t\tarchives instead of the files themselves, their names are\n"
+      "\t\t\tappended to the file name and offsets are relative to them\n"
+      "\t-l\t\tonly print the names of what matched\n"
+      "\t-j <jobs>\tnumber of threads (default: online CPUs)\n"
+      "\n"
+      "Without -e, -x or -f, the first argument is the string to search for.\n"
+      "Returns 0 if something was found, 1 if not.\n", program);
+}
+
+int main (int argc, char *argv[])
+{
+  long jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  uint64_t found = 0;
+  unsigned int next;
+  unsigned int i;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "e:x:f:dlj:")) != -1) {
+    switch (opt) {
+      case 'e':
+        if (!add_pattern (optarg, 0))
+          return -1;
+        break;
+      case 'x':
+        if (!add_pattern (optarg, 1))
+          return -1;
+        break;
+      case 'f':
+        if (!load_patterns (optarg))
+          return -1;
+        break;
+      case 'd':
+        descend = 1;
+        break;
+      case 'l':
+        list_only = 1;
+        break;
+      case 'j':
+        jobs = atoi (optarg);
+        if (jobs >= 1)
+          break;
+        /* fall through */
+      default:
+        usage (argv[0]);
+        return -1;
+    }
+  }
+  if (pattern_count == 0 && optind < argc) {
+    if (!add_pattern (argv[optind], 0))
+      return -1;
+    optind++;
+  }
+  if (pattern_count == 0 || optind == argc) {
+    usage (argv[0]);
+    return -1;
+  }
+  if (jobs < 1)
+    jobs = 1;
+
+  if (!build_automaton ())
+    return -2;
+
+  for (i = optind; i < (unsigned int) argc; i++)
+    add_path (argv[i]);
+
+  for (i = 0; i < path_count; i = next) {
+    for (next = i; next < path_count && input_count < BATCH_SIZE; next++) {
+      add_file (paths[next]);
+      free (paths[next]);
+    }
+    found += scan_items (jobs);
+    fflush (stdout);
+    release_inputs ();
+  }
+
+  if (errors)
+    return -2;
+
+  return found ? 0 : 1;
+}
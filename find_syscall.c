@@ -1,54 +1,864 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
+/* Signatures describe a table by relations between its elements, or
+ * between an element and a value. A signature file holds any number of
+ * them, '#' starts a comment:
+ *
+ *   signature <name>         starts a new signature, printed when found
+ *   width 1|2|4|8            size of the elements in bytes (default 8)
+ *   stride <bytes>           step between the positions that are checked,
+ *                            a power of two multiple of the width up to
+ *                            4096 (default: the width)
+ *   endian big|little        byte order of the elements (default big)
+ *   <index> <rel> [<index>] [mask <mask>]
+ *   <index> <rel> <value> [mask <mask>]
+ *                            element <index> compared to another element
+ *                            or to a value, both and'ed with mask first.
+ *                            <rel> is one of == != < <= > >= (unsigned)
+ *
+ * All the signatures are checked in a single pass over the dump. The one
+ * below is used when no file is given. */
+static const char default_signatures[] =
+  "# lv2: the unimplemented syscalls all point to the same function\n"
+  "signature Syscall table\n"
+  "width 8\n"
+  "1 != [0]\n"
+  "2 != [0]\n"
+  "3 != [0]\n"
+  "14 != [0]\n"
+  "15 == [0]\n"
+  "16 == [0]\n"
+  "17 == [0]\n"
+  "18 != [0]\n"
+  "19 != [0]\n"
+  "20 == [0]\n"
+  "21 != [0]\n"
+  "31 != [0]\n"
+  "32 == [0]\n"
+  "33 == [0]\n"
+  "41 != [0]\n"
+  "42 == [0]\n"
+  "43 != [0]\n";
 
-int main (int argc, char *argv[])
+#define MAX_SIGNATURES 64
+#define MAX_RULES 64
+#define MAX_INDEX 65535
+#define MAX_STRIDE 4096
+
+/* Inputs that can't be mapped are read in windows of this size, each one
+ * starting with the end of the previous one that a table could still
+ * span */
+#define WINDOW_SIZE (8 * 1024 * 1024)
+
+/* Threads take the positions to check in chunks of this many bytes, and
+ * read up to the longest signature's span into the next chunk. Chunks are
+ * scanned in blocks so the data is still in the cache for every
+ * signature. */
+#define CHUNK_SIZE (16 * 1024 * 1024)
+#define BLOCK_SIZE (256 * 1024)
+
+typedef enum {
+  REL_EQ,
+  REL_NE,
+  REL_LT,
+  REL_LE,
+  REL_GT,
+  REL_GE
+} Relation;
+
+typedef struct {
+  unsigned int index;
+  Relation relation;
+  int has_ref;
+  unsigned int ref;
+  /* In host byte order, and as stored in the dump for the vector kernels */
+  uint64_t value;
+  uint64_t mask;
+  uint64_t raw_value;
+  uint64_t raw_mask;
+} Rule;
+
+typedef struct {
+  char name[128];
+  unsigned int width;
+  unsigned int stride;
+  int big_endian;
+  unsigned int span;
+  unsigned int rule_count;
+  /* The == and != rules come first, the vector kernels check those */
+  unsigned int vector_rules;
+  Rule rules[MAX_RULES];
+} Signature;
+
+static Signature signatures[MAX_SIGNATURES];
+static unsigned int signature_count = 0;
+static unsigned int max_span = 0;
+
+typedef struct {
+  uint64_t offset;
+  unsigned int signature;
+} Match;
+
+/* Tables found in a chunk, they are printed once all the chunks are done
+ * so the output stays in offset order */
+typedef struct {
+  Match *matches;
+  size_t count;
+  size_t size;
+  int failed;
+} Results;
+
+static void report (Results *results, uint64_t offset, unsigned int signature)
+{
+  Match *matches;
+
+  if (results->count == results->size) {
+    matches = realloc (results->matches,
+        (results->size * 2 + 16) * sizeof(Match));
+    if (matches == NULL) {
+      results->failed = 1;
+      return;
+    }
+    results->matches = matches;
+    results->size = results->size * 2 + 16;
+  }
+  results->matches[results->count].offset = offset;
+  results->matches[results->count].signature = signature;
+  results->count++;
+}
+
+static uint64_t width_mask (unsigned int width)
+{
+  return width == 8 ? ~(uint64_t) 0 : ((uint64_t) 1 << (width * 8)) - 1;
+}
+
+static uint64_t load (const uint8_t *data, unsigned int width, int big_endian)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  int swap = big_endian;
+#else
+  int swap = !big_endian;
+#endif
+  uint64_t v64;
+  uint32_t v32;
+  uint16_t v16;
+
+  switch (width) {
+    case 8:
+      memcpy (&v64, data, 8);
+      return swap ? __builtin_bswap64 (v64) : v64;
+    case 4:
+      memcpy (&v32, data, 4);
+      return swap ? __builtin_bswap32 (v32) : v32;
+    case 2:
+      memcpy (&v16, data, 2);
+      return swap ? __builtin_bswap16 (v16) : v16;
+    default:
+      return data[0];
+  }
+}
+
+/* The host integer that has the same bytes as value stored in the dump */
+static uint64_t to_raw (uint64_t value, unsigned int width, int big_endian)
+{
+  uint8_t bytes[8];
+  uint64_t raw = 0;
+  unsigned int i;
+
+  for (i = 0; i < width; i++) {
+    if (big_endian)
+      bytes[i] = value >> ((width - 1 - i) * 8);
+    else
+      bytes[i] = value >> (i * 8);
+  }
+  memcpy (&raw, bytes, width);
+
+  return raw;
+}
+
+/* Checks the rules of sig from `first` on against the table at data */
+static int check (const Signature *sig, const uint8_t *data,
+    unsigned int first)
+{
+  const Rule *rule;
+  uint64_t a;
+  uint64_t b;
+  unsigned int i;
+
+  for (i = first; i < sig->rule_count; i++) {
+    rule = &sig->rules[i];
+    a = load (data + rule->index * sig->width, sig->width, sig->big_endian) &
+        rule->mask;
+    if (rule->has_ref)
+      b = load (data + rule->ref * sig->width, sig->width, sig->big_endian) &
+          rule->mask;
+    else
+      b = rule->value;
+
+    switch (rule->relation) {
+      case REL_EQ:
+        if (a != b)
+          return 0;
+        break;
+      case REL_NE:
+        if (a == b)
+          return 0;
+        break;
+      case REL_LT:
+        if (a >= b)
+          return 0;
+        break;
+      case REL_LE:
+        if (a > b)
+          return 0;
+        break;
+      case REL_GT:
+        if (a <= b)
+          return 0;
+        break;
+      case REL_GE:
+        if (a < b)
+          return 0;
+        break;
+    }
+  }
+
+  return 1;
+}
+
+/* Vector kernels check `count` positions that follow each other, one
+ * element apart, in lanes: loading from data + width * index gives element
+ * `index` of every one of them, so each rule is a load and a compare for
+ * all the lanes. The lanes that pass all the == and != rules are then
+ * checked against the other rules one by one. They return how many
+ * positions were checked, the caller does the rest. */
+typedef uint64_t (*VectorKernel) (const Signature *sig, unsigned int id,
+    const uint8_t *data, uint64_t count, uint64_t offset, Results *results);
+
+/* Indexed by element width */
+static VectorKernel vector_kernels[9];
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+
+#define VECTOR_KERNEL(name, isa, vec, width, lanes, LOADU, SET1, AND, \
+    ANDNOT, CMPEQ, ONES, TESTZ, MOVEMASK) \
+__attribute__((target(isa))) \
+static uint64_t name (const Signature *sig, unsigned int id, \
+    const uint8_t *data, uint64_t count, uint64_t offset, Results *results) \
+{ \
+  const Rule *rule; \
+  uint64_t i; \
+  unsigned int k; \
+  int mask; \
+\
+  for (i = 0; i + lanes <= count; i += lanes) { \
+    const uint8_t *table = data + i * width; \
+    vec ok = ONES; \
+    vec a, b; \
+\
+    for (k = 0; k < sig->vector_rules; k++) { \
+      rule = &sig->rules[k]; \
+      a = AND (LOADU ((const vec *) (table + rule->index * width)), \
+          SET1 (rule->raw_mask)); \
+      if (rule->has_ref) \
+        b = AND (LOADU ((const vec *) (table + rule->ref * width)), \
+            SET1 (rule->raw_mask)); \
+      else \
+        b = SET1 (rule->raw_value); \
+      if (rule->relation == REL_EQ) \
+        ok = AND (ok, CMPEQ (a, b)); \
+      else \
+        ok = ANDNOT (CMPEQ (a, b), ok); \
+      /* Most positions are out after the first rules */ \
+      if (TESTZ (ok, ok)) \
+        break; \
+    } \
+    if (k < sig->vector_rules) \
+      continue; \
+\
+    mask = MOVEMASK (ok); \
+    while (mask) { \
+      k = __builtin_ctz (mask); \
+      if (check (sig, table + k * width, sig->vector_rules)) \
+        report (results, offset + (i + k) * width, id); \
+      mask &= mask - 1; \
+    } \
+  } \
+\
+  return i; \
+}
+
+#define MOVEMASK256_64(x) _mm256_movemask_pd (_mm256_castsi256_pd (x))
+#define MOVEMASK256_32(x) _mm256_movemask_ps (_mm256_castsi256_ps (x))
+#define MOVEMASK128_64(x) _mm_movemask_pd (_mm_castsi128_pd (x))
+#define MOVEMASK128_32(x) _mm_movemask_ps (_mm_castsi128_ps (x))
+#define SET1_256_64(x) _mm256_set1_epi64x ((long long) (x))
+#define SET1_256_32(x) _mm256_set1_epi32 ((int) (x))
+#define SET1_128_64(x) _mm_set1_epi64x ((long long) (x))
+#define SET1_128_32(x) _mm_set1_epi32 ((int) (x))
+
+VECTOR_KERNEL (scan_avx2_64, "avx2", __m256i, 8, 4, _mm256_loadu_si256,
+    SET1_256_64, _mm256_and_si256, _mm256_andnot_si256, _mm256_cmpeq_epi64,
+    _mm256_set1_epi64x (-1), _mm256_testz_si256, MOVEMASK256_64)
+VECTOR_KERNEL (scan_avx2_32, "avx2", __m256i, 4, 8, _mm256_loadu_si256,
+    SET1_256_32, _mm256_and_si256, _mm256_andnot_si256, _mm256_cmpeq_epi32,
+    _mm256_set1_epi32 (-1), _mm256_testz_si256, MOVEMASK256_32)
+VECTOR_KERNEL (scan_sse41_64, "sse4.1", __m128i, 8, 2, _mm_loadu_si128,
+    SET1_128_64, _mm_and_si128, _mm_andnot_si128, _mm_cmpeq_epi64,
+    _mm_set1_epi64x (-1), _mm_testz_si128, MOVEMASK128_64)
+VECTOR_KERNEL (scan_sse41_32, "sse4.1", __m128i, 4, 4, _mm_loadu_si128,
+    SET1_128_32, _mm_and_si128, _mm_andnot_si128, _mm_cmpeq_epi32,
+    _mm_set1_epi32 (-1), _mm_testz_si128, MOVEMASK128_32)
+
+#endif /* SCAN_X86 */
+
+/* PS3UTILS_SCAN=generic in the environment forces the scalar loop */
+static void scan_select (void)
 {
-  FILE *in = NULL;
-  char *buf;
-  int i;
-  int ret;
+  const char *force = getenv ("PS3UTILS_SCAN");
 
-  if (argc != 2) {
-    printf ("Usage : %s dump.bin\n", argv[0]);
+  if (force != NULL && strcmp (force, "generic") == 0)
+    return;
+
+#if defined(SCAN_X86)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    vector_kernels[8] = scan_avx2_64;
+    vector_kernels[4] = scan_avx2_32;
+  } else if (__builtin_cpu_supports ("sse4.1")) {
+    vector_kernels[8] = scan_sse41_64;
+    vector_kernels[4] = scan_sse41_32;
+  }
+#endif
+}
+
+/* Checks every position in [start, end) where a table of any signature
+ * could start, as long as it fits before valid_end. data is at offset
+ * data_offset in the dump. */
+static void scan (const uint8_t *data, uint64_t data_offset, uint64_t start,
+    uint64_t end, uint64_t valid_end, Results *results)
+{
+  const Signature *sig;
+  uint64_t first;
+  uint64_t last;
+  uint64_t count;
+  uint64_t done;
+  uint64_t p;
+  unsigned int s;
+
+  for (s = 0; s < signature_count; s++) {
+    sig = &signatures[s];
+    if (valid_end < sig->span)
+      continue;
+    first = (start + sig->stride - 1) / sig->stride * sig->stride;
+    last = valid_end - sig->span + 1;
+    if (last > end)
+      last = end;
+    if (first >= last)
+      continue;
+
+    count = (last - first + sig->stride - 1) / sig->stride;
+    done = 0;
+    if (sig->stride == sig->width && sig->vector_rules > 0 &&
+        vector_kernels[sig->width])
+      done = vector_kernels[sig->width] (sig, s, data + (first - data_offset),
+          count, first, results);
+
+    for (p = first + done * sig->stride; p < last; p += sig->stride) {
+      if (check (sig, data + (p - data_offset), 0))
+        report (results, p, s);
+    }
+  }
+}
+
+static int compare_matches (const void *a, const void *b)
+{
+  const Match *ma = a;
+  const Match *mb = b;
+
+  if (ma->offset != mb->offset)
+    return ma->offset < mb->offset ? -1 : 1;
+
+  return (int) ma->signature - (int) mb->signature;
+}
+
+typedef struct {
+  const uint8_t *data;
+  uint64_t data_offset;
+  uint64_t start;
+  uint64_t end;
+  uint64_t valid_end;
+  uint64_t chunks;
+  uint64_t next_chunk;
+  Results *results;
+} ScanJob;
+
+static void *scan_worker (void *data)
+{
+  ScanJob *job = data;
+  Results *results;
+  uint64_t chunk;
+  uint64_t start;
+  uint64_t end;
+  uint64_t block;
+
+  while (1) {
+    chunk = __atomic_fetch_add (&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= job->chunks)
+      break;
+    start = job->start + chunk * CHUNK_SIZE;
+    end = job->end - start > CHUNK_SIZE ? start + CHUNK_SIZE : job->end;
+    results = &job->results[chunk];
+
+    for (; start < end; start = block) {
+      block = end - start > BLOCK_SIZE ? start + BLOCK_SIZE : end;
+      scan (job->data, job->data_offset, start, block, job->valid_end,
+          results);
+    }
+
+    /* Each block is in offset order for one signature after the other */
+    qsort (results->matches, results->count, sizeof(Match), compare_matches);
+  }
+
+  return NULL;
+}
+
+/* Checks the positions in [start, end) with up to `jobs` threads, the
+ * calling one included, and prints what was found to out */
+static int scan_parallel (const uint8_t *data, uint64_t data_offset,
+    uint64_t start, uint64_t end, uint64_t valid_end, unsigned int jobs,
+    FILE *out)
+{
+  ScanJob job;
+  pthread_t *threads = NULL;
+  unsigned int started = 0;
+  const Match *match;
+  uint64_t chunk;
+  size_t i;
+  int ret = 0;
+
+  if (start >= end)
+    return 0;
+
+  job.data = data;
+  job.data_offset = data_offset;
+  job.start = start;
+  job.end = end;
+  job.valid_end = valid_end;
+  job.chunks = (end - start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  job.next_chunk = 0;
+  job.results = calloc (job.chunks + 1, sizeof(Results));
+  if (job.results == NULL) {
+    perror ("Could not allocate memory ");
     return -1;
   }
 
-  in = fopen (argv[1], "rb");
-  if (in == NULL) {
-    perror ("Could not open input file ");
+  if (jobs > job.chunks)
+    jobs = job.chunks;
+  if (jobs > 1)
+    threads = calloc (jobs - 1, sizeof(pthread_t));
+
+  /* If a thread can't be started, the others just get more chunks */
+  for (started = 0; threads && started < jobs - 1; started++) {
+    if (pthread_create (&threads[started], NULL, scan_worker, &job) != 0)
+      break;
+  }
+  scan_worker (&job);
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+
+  for (chunk = 0; chunk < job.chunks; chunk++) {
+    for (i = 0; i < job.results[chunk].count; i++) {
+      match = &job.results[chunk].matches[i];
+      fprintf (out, "%s found at 0x%llX\n",
+          signatures[match->signature].name,
+          (unsigned long long) match->offset);
+    }
+    if (job.results[chunk].failed && ret == 0) {
+      fprintf (stderr, "Could not allocate memory for the results\n");
+      ret = -1;
+    }
+    free (job.results[chunk].matches);
+  }
+  free (job.results);
+
+  return ret;
+}
+
+static int scan_stream (int fd, uint64_t *total, unsigned int jobs,
+    FILE *out)
+{
+  uint8_t *buf;
+  uint64_t size = WINDOW_SIZE + max_span + MAX_STRIDE;
+  uint64_t base = 0;
+  uint64_t filled = 0;
+  uint64_t end;
+  ssize_t ret;
+  int eof = 0;
+
+  buf = malloc (size);
+  if (buf == NULL) {
+    perror ("Could not allocate memory ");
     return -1;
   }
-  buf = malloc (8*1024*1024);
-  ret = fread(buf, 1, 8*1024*1024, in);
-  printf ("Read %d bytes\n", ret);
-  for (i = 0; i < ret; i+=8) {
-    uint64_t *syscall_table = (uint64_t *)(buf + i);
-    uint64_t sc0 = syscall_table[0];
-
-    if (syscall_table[1] != sc0 &&
-        syscall_table[2] != sc0 &&
-        syscall_table[3] != sc0 &&
-        syscall_table[14] != sc0 &&
-        syscall_table[15] == sc0 &&
-        syscall_table[16] == sc0 &&
-        syscall_table[17] == sc0 &&
-        syscall_table[18] != sc0 &&
-        syscall_table[19] != sc0 &&
-        syscall_table[20] == sc0 &&
-        syscall_table[21] != sc0 &&
-        syscall_table[31] != sc0 &&
-        syscall_table[32] == sc0 &&
-        syscall_table[33] == sc0 &&
-        syscall_table[41] != sc0 &&
-        syscall_table[42] == sc0 &&
-        syscall_table[43] != sc0) {
-      printf ("Syscall table found at 0x%X\n", i);
+
+  *total = 0;
+  while (!eof) {
+    ret = read (fd, buf + filled, size - filled);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0) {
+      perror ("Could not read input file ");
+      free (buf);
+      return -1;
     }
+    filled += ret;
+    *total += ret;
+    eof = ret == 0;
+    if (!eof && filled < size)
+      continue;
+
+    /* Whatever a table could still start in is kept for the next window,
+     * which starts on a multiple of any stride */
+    if (eof)
+      end = base + filled;
+    else
+      end = base + (filled - max_span) / MAX_STRIDE * MAX_STRIDE;
+    if (scan_parallel (buf, base, base, end, base + filled, jobs,
+            out) != 0) {
+      free (buf);
+      return -1;
+    }
+    memmove (buf, buf + (end - base), filled - (end - base));
+    filled -= end - base;
+    base = end;
   }
-  fclose (in);
+
   free (buf);
 
   return 0;
 }
+
+static int parse_number (const char *token, uint64_t *value)
+{
+  char *end = NULL;
+
+  errno = 0;
+  *value = strtoull (token, &end, 0);
+
+  return token[0] != '-' && errno == 0 && end != token && *end == '\0';
+}
+
+static int parse_index (const char *token, unsigned int *index)
+{
+  uint64_t value;
+
+  if (!parse_number (token, &value) || value > MAX_INDEX)
+    return 0;
+  *index = value;
+
+  return 1;
+}
+
+/* == and != go first, the ones against another element first of all since
+ * they reject the most positions, otherwise the order of the file is
+ * kept */
+static unsigned int rule_rank (const Rule *rule)
+{
+  if (rule->relation == REL_EQ && rule->has_ref)
+    return 0;
+  if (rule->relation == REL_EQ)
+    return 1;
+  if (rule->relation == REL_NE)
+    return 2;
+  return 3;
+}
+
+/* Checks a signature once all its lines are read and prepares it for the
+ * scanner. Returns NULL or an error message. */
+static const char *compile_signature (Signature *sig)
+{
+  Rule *rule;
+  Rule moved;
+  unsigned int i, j;
+
+  if (sig->rule_count == 0)
+    return "signature has no rules";
+  if (sig->stride == 0)
+    sig->stride = sig->width;
+  if (sig->stride % sig->width != 0 ||
+      (sig->stride & (sig->stride - 1)) != 0)
+    return "stride must be a power of two multiple of the width";
+
+  for (i = 0; i < sig->rule_count; i++) {
+    rule = &sig->rules[i];
+
+    if (rule->index >= sig->span / sig->width)
+      sig->span = (rule->index + 1) * sig->width;
+    if (rule->has_ref && rule->ref >= sig->span / sig->width)
+      sig->span = (rule->ref + 1) * sig->width;
+
+    if (rule->mask == ~(uint64_t) 0)
+      rule->mask = width_mask (sig->width);
+    if (rule->value > width_mask (sig->width) ||
+        rule->mask > width_mask (sig->width))
+      return "value or mask larger than an element";
+
+    rule->value &= rule->mask;
+    rule->raw_value = to_raw (rule->value, sig->width, sig->big_endian);
+    rule->raw_mask = to_raw (rule->mask, sig->width, sig->big_endian);
+    if (rule->relation == REL_EQ || rule->relation == REL_NE)
+      sig->vector_rules++;
+  }
+
+  for (i = 1; i < sig->rule_count; i++) {
+    moved = sig->rules[i];
+    for (j = i; j > 0 && rule_rank (&sig->rules[j - 1]) > rule_rank (&moved);
+         j--)
+      sig->rules[j] = sig->rules[j - 1];
+    sig->rules[j] = moved;
+  }
+
+  if (sig->span > max_span)
+    max_span = sig->span;
+
+  return NULL;
+}
+
+static const char *parse_rule (Signature *sig, char **tokens,
+    unsigned int count)
+{
+  static const char *relations[] = {"==", "!=", "<", "<=", ">", ">="};
+  Rule *rule;
+  char *token;
+  unsigned int i;
+
+  if (sig->rule_count == MAX_RULES)
+    return "too many rules";
+  rule = &sig->rules[sig->rule_count];
+  memset (rule, 0, sizeof(Rule));
+  rule->mask = ~(uint64_t) 0;
+
+  if (count != 3 && count != 5)
+    return "expected <index> <relation> <[index]|value> [mask <mask>]";
+  if (!parse_index (tokens[0], &rule->index))
+    return "invalid index";
+
+  for (i = 0; i < sizeof(relations) / sizeof(relations[0]); i++) {
+    if (strcmp (tokens[1], relations[i]) == 0)
+      break;
+  }
+  if (i == sizeof(relations) / sizeof(relations[0]))
+    return "relation must be one of == != < <= > >=";
+  rule->relation = (Relation) i;
+
+  token = tokens[2];
+  if (token[0] == '[' && token[strlen (token) - 1] == ']') {
+    token[strlen (token) - 1] = '\0';
+    if (!parse_index (token + 1, &rule->ref))
+      return "invalid index";
+    rule->has_ref = 1;
+  } else if (!parse_number (token, &rule->value)) {
+    return "invalid value";
+  }
+
+  if (count == 5 && (strcmp (tokens[3], "mask") != 0 ||
+          !parse_number (tokens[4], &rule->mask)))
+    return "expected mask <mask>";
+
+  sig->rule_count++;
+
+  return NULL;
+}
+
+/* Parses a line of a signature file, see the format at the top. Returns
+ * NULL or an error message. */
+static const char *parse_line (char *line, Signature **current)
+{
+  Signature *sig = *current;
+  const char *error;
+  char *tokens[8];
+  unsigned int count = 0;
+  char *save = NULL;
+  char *token;
+  uint64_t value;
+  size_t len;
+
+  line[strcspn (line, "#\r\n")] = '\0';
+  line += strspn (line, " \t");
+
+  if (strncmp (line, "signature", 9) == 0 &&
+      (line[9] == ' ' || line[9] == '\t')) {
+    if (sig && (error = compile_signature (sig)) != NULL)
+      return error;
+    if (signature_count == MAX_SIGNATURES)
+      return "too many signatures";
+    sig = &signatures[signature_count++];
+    memset (sig, 0, sizeof(Signature));
+    line += 9 + strspn (line + 9, " \t");
+    for (len = strlen (line); len > 0 &&
+             (line[len - 1] == ' ' || line[len - 1] == '\t'); len--);
+    if (len == 0)
+      return "signature needs a name";
+    snprintf (sig->name, sizeof(sig->name), "%.*s", (int) len, line);
+    sig->width = 8;
+    sig->big_endian = 1;
+    *current = sig;
+    return NULL;
+  }
+
+  for (token = strtok_r (line, " \t", &save); token;
+       token = strtok_r (NULL, " \t", &save)) {
+    if (count == 8)
+      return "too many words";
+    tokens[count++] = token;
+  }
+  if (count == 0)
+    return NULL;
+  if (sig == NULL)
+    return "expected a signature line first";
+
+  if (strcmp (tokens[0], "width") == 0) {
+    if (count != 2 || !parse_number (tokens[1], &value) ||
+        (value != 1 && value != 2 && value != 4 && value != 8))
+      return "width must be 1, 2, 4 or 8";
+    sig->width = value;
+  } else if (strcmp (tokens[0], "stride") == 0) {
+    if (count != 2 || !parse_number (tokens[1], &value) || value == 0 ||
+        value > MAX_STRIDE)
+      return "stride must be between 1 and 4096";
+    sig->stride = value;
+  } else if (strcmp (tokens[0], "endian") == 0) {
+    if (count != 2 || (strcmp (tokens[1], "big") != 0 &&
+            strcmp (tokens[1], "little") != 0))
+      return "endian must be big or little";
+    sig->big_endian = strcmp (tokens[1], "big") == 0;
+  } else {
+    return parse_rule (sig, tokens, count);
+  }
+
+  return NULL;
+}
+
+/* Loads the signatures of a file, or the built-in one if path is NULL */
+static int load_signatures (const char *path)
+{
+  Signature *current = NULL;
+  FILE *in;
+  char line[1024];
+  const char *error = NULL;
+  unsigned int line_number = 0;
+
+  if (path)
+    in = fopen (path, "r");
+  else
+    in = fmemopen ((void *) default_signatures,
+        sizeof(default_signatures) - 1, "r");
+  if (in == NULL) {
+    perror ("Could not open signature file ");
+    return -1;
+  }
+
+  while (error == NULL && fgets (line, sizeof(line), in)) {
+    line_number++;
+    error = parse_line (line, &current);
+  }
+  fclose (in);
+
+  if (error == NULL && current == NULL)
+    error = "no signatures";
+  else if (error == NULL)
+    error = compile_signature (current);
+  if (error) {
+    fprintf (stderr, "%s:%u: %s\n", path ? path : "built-in", line_number,
+        error);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  struct stat st;
+  const uint8_t *map = MAP_FAILED;
+  const char *signature_file = NULL;
+  FILE *matches;
+  char *buffer = NULL;
+  size_t buffer_size = 0;
+  uint64_t total = 0;
+  long jobs = sysconf (_SC_NPROCESSORS_ONLN);
+  int fd;
+  int opt;
+  int ret = 0;
+
+  while ((opt = getopt (argc, argv, "j:s:")) != -1) {
+    if (opt == 's') {
+      signature_file = optarg;
+      continue;
+    }
+    if (opt != 'j' || atoi (optarg) < 1) {
+      jobs = 0;
+      break;
+    }
+    jobs = atoi (optarg);
+  }
+  if (argc - optind != 1 || jobs == 0) {
+    printf ("Usage : %s [-j jobs] [-s signature file] dump.bin\n", argv[0]);
+    return -1;
+  }
+  if (jobs < 1)
+    jobs = 1;
+
+  if (load_signatures (signature_file) != 0)
+    return -1;
+
+  scan_select ();
+
+  fd = open (argv[optind], O_RDONLY);
+  if (fd < 0) {
+    perror ("Could not open input file ");
+    return -1;
+  }
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0)
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (map != MAP_FAILED) {
+    total = st.st_size;
+    printf ("Read %llu bytes\n", (unsigned long long) total);
+    ret = scan_parallel (map, 0, 0, total, total, jobs, stdout);
+    munmap ((void *) map, st.st_size);
+  } else {
+    /* The byte count is printed first, as for mapped input, so the
+     * matches are held until the whole input has been read */
+    matches = open_memstream (&buffer, &buffer_size);
+    if (matches == NULL) {
+      perror ("Could not allocate memory ");
+      close (fd);
+      return -1;
+    }
+    ret = scan_stream (fd, &total, jobs, matches);
+    fclose (matches);
+    if (ret == 0) {
+      printf ("Read %llu bytes\n", (unsigned long long) total);
+      fwrite (buffer, 1, buffer_size, stdout);
+    }
+    free (buffer);
+  }
+  close (fd);
+
+  return ret;
+}
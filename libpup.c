@@ -0,0 +1,2219 @@
+/*
+ * libpup.c -- PS3 PUP update file reader/writer library
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "libpup.h"
+#include "tar.h"
+#include "uring.h"
+
+static const uint8_t hmac_pup_key[] = {
+  0xf4, 0x91, 0xad, 0x94, 0xc6, 0x81, 0x10, 0x96,
+  0x91, 0x5f, 0xd5, 0xd2, 0x44, 0x81, 0xae, 0xdc,
+  0xed, 0xed, 0xbe, 0x6b, 0xe5, 0x13, 0x72, 0x4d,
+  0xd8, 0xf7, 0xb6, 0x91, 0xe8, 0x8a, 0x38, 0xf4,
+  0xb5, 0x16, 0x2b, 0xfb, 0xec, 0xbe, 0x3a, 0x62,
+  0x18, 0x5d, 0xd7, 0xc9, 0x4d, 0xa2, 0x22, 0x5a,
+  0xda, 0x3f, 0xbf, 0xce, 0x55, 0x5b, 0x9e, 0xa9,
+  0x64, 0x98, 0x29, 0xeb, 0x30, 0xce, 0x83, 0x66
+};
+
+/* hmac_pup_key with its pads already hashed */
+static HMAC_KEY pup_key;
+
+__attribute__((constructor))
+static void pup_key_init (void)
+{
+  HMACKeyInit (&pup_key, hmac_pup_key, sizeof(hmac_pup_key));
+}
+
+#define ntohll(x) (((uint64_t) ntohl (x) << 32) | (uint64_t) ntohl (x >> 32) )
+#define htonll(x) (((uint64_t) htonl (x) << 32) | (uint64_t) htonl (x >> 32) )
+
+#define MAX_ENTRIES (sizeof(pup_entries) / sizeof(pup_entries[0]))
+
+/* pup_entry_send () hashes and sends entries in chunks of this size */
+#define SEND_CHUNK_SIZE (1024 * 1024)
+
+/* With PS3UTILS_IO=uring, entries are copied through a ring of this many
+ * buffers, so the next reads and the previous writes overlap the hashing */
+#define URING_DEPTH 8
+#define URING_CHUNK_SIZE (1024 * 1024)
+
+const PUPEntryID pup_entries[] = {
+  {0x100, "version.txt"},
+  {0x101, "license.xml"},
+  {0x102, "promo_flags.txt"},
+  {0x103, "update_flags.txt"},
+  {0x104, "patch_build.txt"},
+  {0x200, "ps3swu.self"},
+  {0x201, "vsh.tar"},
+  {0x202, "dots.txt"},
+  {0x203, "patch_data.pkg"},
+  {0x300, "update_files.tar"},
+  {0, NULL}
+};
+
+struct PUPFile {
+  FILE *fd;
+  int seekable;
+  uint64_t position;
+  const uint8_t *map;
+  uint64_t size;
+  PUPHeader header;
+  PUPFooter footer;
+  PUPFileEntry *files;
+  PUPHashEntry *hashes;
+  uint8_t header_hash[PUP_HASH_LEN];
+};
+
+struct PUPWriter {
+  FILE *inputs[MAX_ENTRIES];
+  const uint8_t *input_maps[MAX_ENTRIES];
+  uint64_t input_sizes[MAX_ENTRIES];
+  PUPHeader header;
+  PUPFooter footer;
+  PUPFileEntry *files;
+  PUPHashEntry *hashes;
+  unsigned int threads;
+  PUPHashCache *cache;
+  char *input_paths[MAX_ENTRIES];
+  struct stat input_stats[MAX_ENTRIES];
+  int hashed[MAX_ENTRIES];
+};
+
+typedef struct {
+  char *path;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint8_t hash[PUP_HASH_LEN];
+} PUPHashCacheEntry;
+
+struct PUPHashCache {
+  char *path;
+  PUPHashCacheEntry *entries;
+  unsigned int count;
+  int dirty;
+};
+
+const char *pup_strerror (int error)
+{
+  switch (error) {
+    case PUP_OK:
+      return "Success";
+    case PUP_ERROR_OPEN:
+      return "Couldn't open file";
+    case PUP_ERROR_READ:
+      return "Couldn't read all the data";
+    case PUP_ERROR_WRITE:
+      return "Couldn't write all the data";
+    case PUP_ERROR_NO_MEMORY:
+      return "Out of memory";
+    case PUP_ERROR_BAD_MAGIC:
+      return "Not a PUP file, wrong magic number";
+    case PUP_ERROR_HEADER_HASH:
+      return "PUP file is corrupted, wrong header hash";
+    case PUP_ERROR_FILE_HASH:
+      return "PUP file is corrupted, wrong file hash";
+    case PUP_ERROR_OUT_OF_BOUNDS:
+      return "Entry data is out of the PUP file bounds";
+    case PUP_ERROR_INVALID:
+      return "Invalid argument";
+    case PUP_ERROR_NOT_SEEKABLE:
+      return "Entry data is behind the current position of a stream";
+    case PUP_ERROR_CANCELED:
+      return "Entry skipped after an earlier error";
+    default:
+      return "Unknown error";
+  }
+}
+
+const char *pup_id_to_filename (uint64_t entry_id)
+{
+  const PUPEntryID *entry = pup_entries;
+
+  while (entry->id) {
+    if (entry->id == entry_id)
+      return entry->filename;
+    entry++;
+  }
+  return NULL;
+}
+
+uint64_t pup_filename_to_id (const char *filename)
+{
+  const PUPEntryID *entry = pup_entries;
+
+  while (entry->id) {
+    if (strcmp (entry->filename, filename) == 0)
+      return entry->id;
+    entry++;
+  }
+  return 0;
+}
+
+void pup_hash_init (PUPHashContext *context)
+{
+  HMACInitKeyed (&context->context, &pup_key);
+}
+
+void pup_hash_update (PUPHashContext *context, const void *data, uint64_t len)
+{
+  HMACUpdate64 (&context->context, data, len);
+}
+
+void pup_hash_final (PUPHashContext *context, uint8_t hash[PUP_HASH_LEN])
+{
+  HMACFinal (hash, &context->context);
+}
+
+void pup_hash (const void *data, uint64_t len, uint8_t hash[PUP_HASH_LEN])
+{
+  PUPHashContext context;
+
+  pup_hash_init (&context);
+  pup_hash_update (&context, data, len);
+  pup_hash_final (&context, hash);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Map a whole file read-only so PUP entries can be hashed and written
+ * straight from the page cache. Returns NULL if the file can't be mapped
+ * (pipes, special files, empty files...) in which case the caller falls
+ * back to stdio. */
+static const uint8_t *map_file (FILE *fd, uint64_t *size)
+{
+  struct stat stat_buf;
+  void *map;
+
+  if (fstat (fileno (fd), &stat_buf) != 0 || !S_ISREG (stat_buf.st_mode) ||
+      stat_buf.st_size == 0)
+    return NULL;
+
+  map = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fileno (fd), 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  madvise (map, stat_buf.st_size, MADV_SEQUENTIAL);
+  *size = stat_buf.st_size;
+
+  return map;
+}
+
+static int write_all (int fd, const uint8_t *data, uint64_t len)
+{
+  ssize_t written;
+
+  while (len > 0) {
+    written = write (fd, data, len > SSIZE_MAX ? SSIZE_MAX : len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return 0;
+    data += written;
+    len -= written;
+  }
+
+  return 1;
+}
+
+typedef struct {
+  void (*func) (void *data, unsigned int index);
+  void *data;
+  unsigned int count;
+  unsigned int next;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+static void *work_queue_thread (void *user_data)
+{
+  WorkQueue *queue = user_data;
+  unsigned int index;
+
+  while (1) {
+    pthread_mutex_lock (&queue->lock);
+    index = queue->next++;
+    pthread_mutex_unlock (&queue->lock);
+
+    if (index >= queue->count)
+      break;
+    queue->func (queue->data, index);
+  }
+
+  return NULL;
+}
+
+void pup_run_parallel (unsigned int count, unsigned int jobs,
+    void (*func) (void *data, unsigned int index), void *data)
+{
+  WorkQueue queue;
+  pthread_t *threads = NULL;
+  unsigned int started = 0;
+  unsigned int i;
+
+  queue.func = func;
+  queue.data = data;
+  queue.count = count;
+  queue.next = 0;
+  pthread_mutex_init (&queue.lock, NULL);
+
+  if (jobs > count)
+    jobs = count;
+  if (jobs > 1)
+    threads = malloc ((jobs - 1) * sizeof(pthread_t));
+
+  /* The calling thread is one of the workers, and if a thread can't be
+   * created the remaining ones simply pick up more of the work. */
+  for (i = 0; threads && i < jobs - 1; i++) {
+    if (pthread_create (&threads[started], NULL,
+            work_queue_thread, &queue) == 0)
+      started++;
+  }
+  work_queue_thread (&queue);
+
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  free (threads);
+  pthread_mutex_destroy (&queue.lock);
+}
+
+
+static int open_stream (FILE *fd, PUPFile **ret)
+{
+  PUPFile *pup = NULL;
+  PUPHeader orig_header;
+  HMAC_CTX context;
+  uint64_t tables;
+  unsigned int i;
+  int error;
+
+  *ret = NULL;
+
+  pup = calloc (1, sizeof(PUPFile));
+  if (pup == NULL) {
+    fclose (fd);
+    return PUP_ERROR_NO_MEMORY;
+  }
+  pup->fd = fd;
+  pup->seekable = lseek (fileno (fd), 0, SEEK_CUR) >= 0;
+
+  if (fread (&orig_header, sizeof(PUPHeader), 1, pup->fd) != 1) {
+    error = PUP_ERROR_READ;
+    goto error;
+  }
+
+  pup->header.magic = ntohll(orig_header.magic);
+  pup->header.package_version = ntohll(orig_header.package_version);
+  pup->header.image_version = ntohll(orig_header.image_version);
+  pup->header.file_count = ntohll(orig_header.file_count);
+  pup->header.header_length = ntohll(orig_header.header_length);
+  pup->header.data_length = ntohll(orig_header.data_length);
+
+  if (pup->header.magic != PUP_MAGIC) {
+    error = PUP_ERROR_BAD_MAGIC;
+    goto error;
+  }
+
+  /* The tables have to fit in the header, which is tiny in practice */
+  tables = pup->header.file_count;
+  if (tables > pup->header.header_length / sizeof(PUPFileEntry)) {
+    error = PUP_ERROR_OUT_OF_BOUNDS;
+    goto error;
+  }
+
+  pup->files = calloc (tables + 1, sizeof(PUPFileEntry));
+  pup->hashes = calloc (tables + 1, sizeof(PUPHashEntry));
+  if (pup->files == NULL || pup->hashes == NULL) {
+    error = PUP_ERROR_NO_MEMORY;
+    goto error;
+  }
+
+  if (fread (pup->files, sizeof(PUPFileEntry), tables, pup->fd) != tables ||
+      fread (pup->hashes, sizeof(PUPHashEntry), tables, pup->fd) != tables ||
+      fread (&pup->footer, sizeof(PUPFooter), 1, pup->fd) != 1) {
+    error = PUP_ERROR_READ;
+    goto error;
+  }
+  pup->position = sizeof(PUPHeader) + sizeof(PUPFooter) +
+      tables * (sizeof(PUPFileEntry) + sizeof(PUPHashEntry));
+
+  HMACInitKeyed (&context, &pup_key);
+  HMACUpdate (&context, &orig_header, sizeof(PUPHeader));
+  HMACUpdate64 (&context, pup->files, tables * sizeof(PUPFileEntry));
+  HMACUpdate64 (&context, pup->hashes, tables * sizeof(PUPHashEntry));
+  HMACFinal (pup->header_hash, &context);
+
+  for (i = 0; i < tables; i++) {
+    pup->files[i].entry_id = ntohll (pup->files[i].entry_id);
+    pup->files[i].data_offset = ntohll (pup->files[i].data_offset);
+    pup->files[i].data_length = ntohll (pup->files[i].data_length);
+    pup->hashes[i].entry_id = ntohll (pup->hashes[i].entry_id);
+  }
+
+  pup->map = map_file (pup->fd, &pup->size);
+
+  *ret = pup;
+
+  if (memcmp (pup->header_hash, pup->footer.hash, PUP_HASH_LEN) != 0)
+    return PUP_ERROR_HEADER_HASH;
+
+  return PUP_OK;
+
+ error:
+  i = errno;
+  pup_close (pup);
+  errno = i;
+
+  return error;
+}
+
+int pup_open (const char *path, PUPFile **pup)
+{
+  FILE *fd;
+
+  *pup = NULL;
+
+  fd = fopen (path, "rb");
+  if (fd == NULL)
+    return PUP_ERROR_OPEN;
+
+  return open_stream (fd, pup);
+}
+
+int pup_open_fd (int fd, PUPFile **pup)
+{
+  FILE *stream;
+
+  *pup = NULL;
+
+  stream = fdopen (fd, "rb");
+  if (stream == NULL)
+    return PUP_ERROR_OPEN;
+
+  return open_stream (stream, pup);
+}
+
+void pup_close (PUPFile *pup)
+{
+  if (pup == NULL)
+    return;
+
+  if (pup->map)
+    munmap ((void *) pup->map, pup->size);
+  if (pup->fd)
+    fclose (pup->fd);
+  free (pup->files);
+  free (pup->hashes);
+  free (pup);
+}
+
+const PUPHeader *pup_get_header (const PUPFile *pup)
+{
+  return &pup->header;
+}
+
+const PUPFooter *pup_get_footer (const PUPFile *pup)
+{
+  return &pup->footer;
+}
+
+const PUPFileEntry *pup_get_files (const PUPFile *pup)
+{
+  return pup->files;
+}
+
+const PUPHashEntry *pup_get_hashes (const PUPFile *pup)
+{
+  return pup->hashes;
+}
+
+void pup_get_header_hash (const PUPFile *pup, uint8_t hash[PUP_HASH_LEN])
+{
+  memcpy (hash, pup->header_hash, PUP_HASH_LEN);
+}
+
+uint64_t pup_get_size (const PUPFile *pup)
+{
+  return pup->size;
+}
+
+int pup_find_entry (const PUPFile *pup, uint64_t entry_id)
+{
+  unsigned int i;
+
+  for (i = 0; i < pup->header.file_count; i++) {
+    if (pup->files[i].entry_id == entry_id)
+      return i;
+  }
+  return -1;
+}
+
+int pup_entry_data (const PUPFile *pup, unsigned int index,
+    const uint8_t **data)
+{
+  const PUPFileEntry *file;
+
+  *data = NULL;
+  if (pup->map == NULL || index >= pup->header.file_count)
+    return PUP_ERROR_INVALID;
+
+  file = &pup->files[index];
+  if (file->data_offset > pup->size ||
+      file->data_length > pup->size - file->data_offset)
+    return PUP_ERROR_OUT_OF_BOUNDS;
+
+  *data = pup->map + file->data_offset;
+
+  return PUP_OK;
+}
+
+
+typedef struct {
+  PUPFile *pup;
+  PUPEntryJob *job;
+  int hashed;
+  URing *ring;
+} JobState;
+
+static void hash_chunk (void *data, const uint8_t *chunk, size_t len)
+{
+  pup_hash_update ((PUPHashContext *) data, chunk, len);
+}
+
+static void skip_chunk (void *data, const uint8_t *chunk, size_t len)
+{
+}
+
+/* Copies an entry of a mapped PUP to out with the ring instead of writing
+ * it from the mapping, hashing it on the way unless that's already done */
+static void run_uring_job (JobState *state, int out)
+{
+  PUPEntryJob *job = state->job;
+  const PUPFileEntry *file = &state->pup->files[job->index];
+  PUPHashContext context;
+  int ret;
+
+  pup_hash_init (&context);
+  ret = uring_copy (state->ring, fileno (state->pup->fd), file->data_offset,
+      out, 0, file->data_length, state->hashed ? skip_chunk : hash_chunk,
+      &context);
+  if (ret != URING_OK) {
+    job->error = ret == URING_ERROR_READ ? PUP_ERROR_READ : PUP_ERROR_WRITE;
+    job->error_errno = errno;
+    return;
+  }
+  if (!state->hashed)
+    pup_hash_final (&context, job->hash);
+}
+
+/* Zero-copy processing of a single entry of a mapped PUP. This may run in
+ * a worker thread, so it only touches its own job. */
+static void run_mapped_job (void *data, unsigned int index)
+{
+  JobState *state = (JobState *) data + index;
+  PUPEntryJob *job = state->job;
+  const PUPFileEntry *file = &state->pup->files[job->index];
+  const uint8_t *entry_data;
+  double start = now ();
+  int out;
+
+  job->error = pup_entry_data (state->pup, job->index, &entry_data);
+  if (job->error != PUP_OK)
+    return;
+
+  if (!state->hashed && (state->ring == NULL || job->path == NULL))
+    pup_hash (entry_data, file->data_length, job->hash);
+
+  if (job->path) {
+    out = open (job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+      job->error = PUP_ERROR_OPEN;
+      job->error_errno = errno;
+      return;
+    }
+
+    if (state->ring) {
+      run_uring_job (state, out);
+      if (job->error != PUP_OK) {
+        close (out);
+        return;
+      }
+    } else if (!write_all (out, entry_data, file->data_length)) {
+      job->error = PUP_ERROR_WRITE;
+      job->error_errno = errno;
+      close (out);
+      return;
+    }
+
+    if (close (out) != 0) {
+      job->error = PUP_ERROR_WRITE;
+      job->error_errno = errno;
+      return;
+    }
+  }
+
+  if (!state->hashed)
+    job->elapsed = now () - start;
+}
+
+/* When the SHA-1 code can hash several messages in lockstep faster than one
+ * after the other, hash all the entries in a single batch so the jobs only
+ * have to write them out. Since the entries are hashed together, each one
+ * is credited with a share of the time proportional to its size. With
+ * skip_copies, the jobs that write their entry out are left to hash it
+ * while it's copied. */
+static void hash_mapped_jobs (JobState *states, unsigned int count,
+    int skip_copies)
+{
+  const uint8_t **addr = NULL;
+  size_t *len = NULL;
+  uint8_t *macs = NULL;
+  unsigned int *index = NULL;
+  unsigned int batch = 0;
+  unsigned int i;
+  uint64_t total = 0;
+  double start;
+
+  if (sha1_multi_lanes () < 2 || count < 2)
+    return;
+
+  addr = malloc (count * sizeof(uint8_t *));
+  len = malloc (count * sizeof(size_t));
+  macs = malloc (count * PUP_HASH_LEN);
+  index = malloc (count * sizeof(unsigned int));
+  if (addr == NULL || len == NULL || macs == NULL || index == NULL)
+    goto done;
+
+  for (i = 0; i < count; i++) {
+    PUPEntryJob *job = states[i].job;
+
+    if (skip_copies && job->path)
+      continue;
+    if (pup_entry_data (states[i].pup, job->index, &addr[batch]) != PUP_OK)
+      continue;
+    len[batch] = states[i].pup->files[job->index].data_length;
+    total += len[batch];
+    index[batch++] = i;
+  }
+
+  start = now ();
+  hmac_sha1_multi_keyed (&pup_key, batch, addr, len, macs);
+  start = now () - start;
+
+  for (i = 0; i < batch; i++) {
+    JobState *state = &states[index[i]];
+
+    memcpy (state->job->hash, macs + i * PUP_HASH_LEN, PUP_HASH_LEN);
+    state->job->elapsed = total ? start * len[i] / total : 0;
+    state->hashed = 1;
+  }
+
+ done:
+  free (addr);
+  free (len);
+  free (macs);
+  free (index);
+}
+
+/* Moves the input of a PUP that couldn't be mapped to offset. Streams can
+ * only go forward, so the data in between is read and thrown away. */
+static int stream_seek (PUPFile *pup, uint64_t offset)
+{
+  uint8_t buffer[64 * 1024];
+  uint64_t len;
+
+  if (offset == pup->position)
+    return PUP_OK;
+
+  if (pup->seekable) {
+    if (fseeko (pup->fd, offset, SEEK_SET) != 0)
+      return PUP_ERROR_READ;
+    pup->position = offset;
+    return PUP_OK;
+  }
+
+  if (offset < pup->position)
+    return PUP_ERROR_NOT_SEEKABLE;
+
+  while (pup->position < offset) {
+    len = offset - pup->position;
+    if (len > sizeof(buffer))
+      len = sizeof(buffer);
+    if (fread (buffer, 1, len, pup->fd) != len)
+      return PUP_ERROR_READ;
+    pup->position += len;
+  }
+
+  return PUP_OK;
+}
+
+/* Processes an entry of a PUP that couldn't be mapped. The entry goes to
+ * the job's path if it has one, otherwise to out_fd unless it's -1. */
+static void run_stream_job (PUPFile *pup, PUPEntryJob *job, int out_fd)
+{
+  const PUPFileEntry *file = &pup->files[job->index];
+  uint8_t buffer[64 * 1024];
+  PUPHashContext context;
+  uint64_t remaining = file->data_length;
+  int out = out_fd;
+  double start = now ();
+  size_t len;
+
+  /* Empty entries have nothing to read, wherever they point */
+  if (remaining > 0)
+    job->error = stream_seek (pup, file->data_offset);
+  if (job->error != PUP_OK) {
+    job->error_errno = errno;
+    return;
+  }
+
+  if (job->path) {
+    out = open (job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+      job->error = PUP_ERROR_OPEN;
+      job->error_errno = errno;
+      return;
+    }
+  }
+
+  pup_hash_init (&context);
+
+  while (remaining > 0) {
+    len = remaining > sizeof(buffer) ? sizeof(buffer) : remaining;
+
+    if (fread (buffer, 1, len, pup->fd) != len) {
+      job->error = PUP_ERROR_READ;
+      job->error_errno = errno;
+      goto done;
+    }
+    pup->position += len;
+
+    pup_hash_update (&context, buffer, len);
+
+    if (out >= 0 && !write_all (out, buffer, len)) {
+      job->error = PUP_ERROR_WRITE;
+      job->error_errno = errno;
+      goto done;
+    }
+    remaining -= len;
+  }
+
+  pup_hash_final (&context, job->hash);
+  job->elapsed = now () - start;
+
+ done:
+  if (job->path && close (out) != 0 && job->error == PUP_OK) {
+    job->error = PUP_ERROR_WRITE;
+    job->error_errno = errno;
+  }
+}
+
+static int check_job (PUPFile *pup, PUPEntryJob *job)
+{
+  if (job->error == PUP_OK &&
+      memcmp (job->hash, pup->hashes[job->index].hash, PUP_HASH_LEN) != 0)
+    job->error = PUP_ERROR_FILE_HASH;
+
+  return job->error == PUP_OK;
+}
+
+int pup_run_jobs (PUPFile *pup, PUPEntryJob *jobs, unsigned int count,
+    unsigned int threads, int stop_on_error)
+{
+  JobState *states = NULL;
+  unsigned int *order = NULL;
+  URing *ring;
+  unsigned int i, j;
+  int stopped = 0;
+
+  for (i = 0; i < count; i++) {
+    if (jobs[i].index >= pup->header.file_count)
+      return PUP_ERROR_INVALID;
+    jobs[i].error = PUP_OK;
+    jobs[i].error_errno = 0;
+    jobs[i].elapsed = 0;
+  }
+
+  /* Without a mapping the input is read front to back, in data_offset
+   * order, so streams never have to go backwards */
+  if (pup->map == NULL) {
+    order = calloc (count + 1, sizeof(unsigned int));
+    if (order == NULL)
+      return PUP_ERROR_NO_MEMORY;
+
+    for (i = 0; i < count; i++) {
+      uint64_t offset = pup->files[jobs[i].index].data_offset;
+
+      for (j = i; j > 0 &&
+               pup->files[jobs[order[j - 1]].index].data_offset > offset; j--)
+        order[j] = order[j - 1];
+      order[j] = i;
+    }
+
+    for (i = 0; i < count; i++) {
+      if (stopped) {
+        jobs[order[i]].error = PUP_ERROR_CANCELED;
+        continue;
+      }
+      run_stream_job (pup, &jobs[order[i]], -1);
+      stopped = !check_job (pup, &jobs[order[i]]) && stop_on_error;
+    }
+    free (order);
+    goto check;
+  }
+
+  states = calloc (count, sizeof(JobState));
+  if (states == NULL)
+    return PUP_ERROR_NO_MEMORY;
+  for (i = 0; i < count; i++) {
+    states[i].pup = pup;
+    states[i].job = &jobs[i];
+  }
+
+  /* Entries are independent ranges, so they can all be processed at the
+   * same time by the worker pool */
+  if (threads > 1) {
+    pup_run_parallel (count, threads, run_mapped_job, states);
+  } else {
+    /* The ring hashes entries while they are copied, batching those would
+     * take the hashing out of the pipeline */
+    ring = uring_new (URING_DEPTH, URING_CHUNK_SIZE);
+    hash_mapped_jobs (states, count, ring != NULL);
+    for (i = 0; i < count; i++) {
+      if (stopped) {
+        jobs[i].error = PUP_ERROR_CANCELED;
+        continue;
+      }
+      states[i].ring = ring;
+      run_mapped_job (states, i);
+      stopped = !check_job (pup, &jobs[i]) && stop_on_error;
+    }
+    uring_free (ring);
+  }
+  free (states);
+
+ check:
+  for (i = 0; i < count; i++)
+    check_job (pup, &jobs[i]);
+  for (i = 0; i < count; i++) {
+    if (jobs[i].error != PUP_OK && jobs[i].error != PUP_ERROR_CANCELED)
+      return jobs[i].error;
+  }
+
+  return PUP_OK;
+}
+
+
+/* Sends a chunk of the PUP to out_fd without copying it to userspace. Returns
+ * 0 with errno set to EINVAL or ENOSYS if the kernel can't do it for that
+ * output, so the caller can fall back to write (). */
+static int send_range (int in_fd, int out_fd, uint64_t offset, uint64_t len)
+{
+  off_t position = offset;
+  ssize_t sent;
+
+  while (len > 0) {
+    sent = sendfile (out_fd, in_fd, &position,
+        len > SSIZE_MAX ? SSIZE_MAX : len);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0) {
+      if (sent == 0)
+        errno = EIO;
+      return 0;
+    }
+    len -= sent;
+  }
+
+  return 1;
+}
+
+int pup_entry_send (PUPFile *pup, unsigned int index, int out_fd,
+    uint8_t hash[PUP_HASH_LEN])
+{
+  const PUPFileEntry *file;
+  const uint8_t *data;
+  PUPHashContext context;
+  PUPEntryJob job;
+  uint64_t done = 0;
+  uint64_t len;
+  int use_sendfile = 1;
+  int ret;
+
+  if (index >= pup->header.file_count)
+    return PUP_ERROR_INVALID;
+
+  file = &pup->files[index];
+
+  /* Without a mapping there is nothing to hand to the kernel, so copy it
+   * through a buffer like any other stream */
+  if (pup->map == NULL) {
+    memset (&job, 0, sizeof(job));
+    job.index = index;
+    run_stream_job (pup, &job, out_fd);
+    memcpy (hash, job.hash, PUP_HASH_LEN);
+    if (job.error == PUP_OK &&
+        memcmp (hash, pup->hashes[index].hash, PUP_HASH_LEN) != 0)
+      return PUP_ERROR_FILE_HASH;
+    errno = job.error_errno;
+    return job.error;
+  }
+
+  ret = pup_entry_data (pup, index, &data);
+  if (ret != PUP_OK)
+    return ret;
+
+  /* Each chunk is hashed right before it's sent, while it's still in the
+   * cache, so the entry is only read once */
+  pup_hash_init (&context);
+  while (done < file->data_length) {
+    len = file->data_length - done;
+    if (len > SEND_CHUNK_SIZE)
+      len = SEND_CHUNK_SIZE;
+
+    pup_hash_update (&context, data + done, len);
+
+    if (use_sendfile &&
+        !send_range (fileno (pup->fd), out_fd, file->data_offset + done, len)) {
+      if (errno != EINVAL && errno != ENOSYS)
+        return PUP_ERROR_WRITE;
+      use_sendfile = 0;
+    }
+    if (!use_sendfile && !write_all (out_fd, data + done, len))
+      return PUP_ERROR_WRITE;
+
+    done += len;
+  }
+  pup_hash_final (&context, hash);
+
+  if (memcmp (hash, pup->hashes[index].hash, PUP_HASH_LEN) != 0)
+    return PUP_ERROR_FILE_HASH;
+
+  return PUP_OK;
+}
+
+/* Hash cache. Each line of the cache file holds the HMAC of an input
+ * followed by the (dev, inode, size, mtime) it was computed for and the
+ * input's absolute path. Any line that doesn't parse is dropped, and a
+ * file without the expected first line is ignored entirely. */
+#define HASH_CACHE_MAGIC "pup-hash-cache 1"
+
+/* Files modified this recently may still change within the same mtime, so
+ * their hashes are never cached */
+#define HASH_CACHE_RACY_SECONDS 2
+
+static void stat_to_cache_entry (const struct stat *stat_buf,
+    PUPHashCacheEntry *entry)
+{
+  entry->dev = stat_buf->st_dev;
+  entry->ino = stat_buf->st_ino;
+  entry->size = stat_buf->st_size;
+  entry->mtime_sec = stat_buf->st_mtim.tv_sec;
+  entry->mtime_nsec = stat_buf->st_mtim.tv_nsec;
+}
+
+static int cache_entry_matches (const PUPHashCacheEntry *a,
+    const PUPHashCacheEntry *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+      a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static PUPHashCacheEntry *hash_cache_find (PUPHashCache *cache,
+    const char *path)
+{
+  unsigned int i;
+
+  for (i = 0; i < cache->count; i++) {
+    if (strcmp (cache->entries[i].path, path) == 0)
+      return &cache->entries[i];
+  }
+  return NULL;
+}
+
+static int hash_cache_add (PUPHashCache *cache, const char *path,
+    const PUPHashCacheEntry *key, const uint8_t hash[PUP_HASH_LEN])
+{
+  PUPHashCacheEntry *entry = hash_cache_find (cache, path);
+  PUPHashCacheEntry *entries;
+
+  if (entry == NULL) {
+    entries = realloc (cache->entries,
+        (cache->count + 1) * sizeof(PUPHashCacheEntry));
+    if (entries == NULL)
+      return PUP_ERROR_NO_MEMORY;
+    cache->entries = entries;
+    entry = &cache->entries[cache->count];
+    entry->path = strdup (path);
+    if (entry->path == NULL)
+      return PUP_ERROR_NO_MEMORY;
+    cache->count++;
+  }
+
+  entry->dev = key->dev;
+  entry->ino = key->ino;
+  entry->size = key->size;
+  entry->mtime_sec = key->mtime_sec;
+  entry->mtime_nsec = key->mtime_nsec;
+  memcpy (entry->hash, hash, PUP_HASH_LEN);
+  cache->dirty = 1;
+
+  return PUP_OK;
+}
+
+static int parse_cache_line (char *line, PUPHashCacheEntry *entry)
+{
+  unsigned long long dev, ino, size;
+  long long mtime_sec, mtime_nsec;
+  unsigned int byte;
+  int path_start = 0;
+  int i;
+
+  for (i = 0; i < PUP_HASH_LEN; i++) {
+    if (sscanf (line + i * 2, "%2x", &byte) != 1)
+      return 0;
+    entry->hash[i] = byte;
+  }
+
+  if (sscanf (line + PUP_HASH_LEN * 2, " %llu %llu %llu %lld.%lld %n",
+          &dev, &ino, &size, &mtime_sec, &mtime_nsec, &path_start) != 5 ||
+      path_start == 0 || line[PUP_HASH_LEN * 2 + path_start] != '/')
+    return 0;
+
+  entry->path = line + PUP_HASH_LEN * 2 + path_start;
+  entry->dev = dev;
+  entry->ino = ino;
+  entry->size = size;
+  entry->mtime_sec = mtime_sec;
+  entry->mtime_nsec = mtime_nsec;
+
+  return 1;
+}
+
+int pup_hash_cache_load (const char *path, PUPHashCache **ret)
+{
+  PUPHashCache *cache;
+  PUPHashCacheEntry entry;
+  char line[PATH_MAX + 128];
+  FILE *fd;
+  size_t len;
+  int error = PUP_OK;
+
+  *ret = NULL;
+
+  cache = calloc (1, sizeof(PUPHashCache));
+  if (cache == NULL)
+    return PUP_ERROR_NO_MEMORY;
+  cache->path = strdup (path);
+  if (cache->path == NULL) {
+    free (cache);
+    return PUP_ERROR_NO_MEMORY;
+  }
+
+  /* A missing cache is just an empty one */
+  fd = fopen (path, "r");
+  if (fd == NULL) {
+    if (errno != ENOENT) {
+      pup_hash_cache_free (cache);
+      return PUP_ERROR_OPEN;
+    }
+    *ret = cache;
+    return PUP_OK;
+  }
+
+  if (fgets (line, sizeof(line), fd) == NULL ||
+      strcmp (line, HASH_CACHE_MAGIC "\n") != 0)
+    goto done;
+
+  while (fgets (line, sizeof(line), fd) != NULL) {
+    len = strlen (line);
+    if (len == 0 || line[len - 1] != '\n')
+      continue;
+    line[len - 1] = '\0';
+
+    if (!parse_cache_line (line, &entry))
+      continue;
+    error = hash_cache_add (cache, entry.path, &entry, entry.hash);
+    if (error != PUP_OK)
+      break;
+  }
+
+ done:
+  fclose (fd);
+  if (error != PUP_OK) {
+    pup_hash_cache_free (cache);
+    return error;
+  }
+  cache->dirty = 0;
+  *ret = cache;
+
+  return PUP_OK;
+}
+
+void pup_hash_cache_clear (PUPHashCache *cache)
+{
+  unsigned int i;
+
+  for (i = 0; i < cache->count; i++)
+    free (cache->entries[i].path);
+  cache->count = 0;
+  cache->dirty = 1;
+}
+
+/* Entries for files that are gone or have changed since are dropped, so
+ * the cache doesn't keep growing. The new cache replaces the old one with
+ * a rename, a reader never sees a partially written file. */
+int pup_hash_cache_save (PUPHashCache *cache)
+{
+  PUPHashCacheEntry current;
+  struct stat stat_buf;
+  char tmp_path[PATH_MAX + 1];
+  unsigned int i, j;
+  FILE *fd;
+  int saved_errno;
+
+  if (!cache->dirty)
+    return PUP_OK;
+
+  if (snprintf (tmp_path, sizeof(tmp_path), "%s.tmp", cache->path) >=
+      (int) sizeof(tmp_path)) {
+    errno = ENAMETOOLONG;
+    return PUP_ERROR_OPEN;
+  }
+
+  fd = fopen (tmp_path, "w");
+  if (fd == NULL)
+    return PUP_ERROR_OPEN;
+
+  fprintf (fd, HASH_CACHE_MAGIC "\n");
+  for (i = 0; i < cache->count; i++) {
+    PUPHashCacheEntry *entry = &cache->entries[i];
+
+    if (stat (entry->path, &stat_buf) != 0)
+      continue;
+    stat_to_cache_entry (&stat_buf, &current);
+    if (!cache_entry_matches (entry, &current))
+      continue;
+
+    for (j = 0; j < PUP_HASH_LEN; j++)
+      fprintf (fd, "%.2x", entry->hash[j]);
+    fprintf (fd, " %llu %llu %llu %lld.%09lld %s\n",
+        (unsigned long long) entry->dev, (unsigned long long) entry->ino,
+        (unsigned long long) entry->size, (long long) entry->mtime_sec,
+        (long long) entry->mtime_nsec, entry->path);
+  }
+
+  if (ferror (fd) || fflush (fd) != 0 || fsync (fileno (fd)) != 0) {
+    saved_errno = errno;
+    fclose (fd);
+    unlink (tmp_path);
+    errno = saved_errno;
+    return PUP_ERROR_WRITE;
+  }
+  if (fclose (fd) != 0 || rename (tmp_path, cache->path) != 0) {
+    saved_errno = errno;
+    unlink (tmp_path);
+    errno = saved_errno;
+    return PUP_ERROR_WRITE;
+  }
+  cache->dirty = 0;
+
+  return PUP_OK;
+}
+
+void pup_hash_cache_free (PUPHashCache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  pup_hash_cache_clear (cache);
+  free (cache->entries);
+  free (cache->path);
+  free (cache);
+}
+
+/* Takes the hashes of unchanged inputs from the cache */
+static void lookup_cached_hashes (PUPWriter *writer)
+{
+  PUPHashCacheEntry current;
+  PUPHashCacheEntry *entry;
+  unsigned int i;
+
+  for (i = 0; i < writer->header.file_count; i++) {
+    writer->hashed[i] = 0;
+    if (writer->cache == NULL || writer->input_paths[i] == NULL ||
+        !S_ISREG (writer->input_stats[i].st_mode))
+      continue;
+
+    entry = hash_cache_find (writer->cache, writer->input_paths[i]);
+    stat_to_cache_entry (&writer->input_stats[i], &current);
+    if (entry && cache_entry_matches (entry, &current)) {
+      memcpy (writer->hashes[i].hash, entry->hash, PUP_HASH_LEN);
+      writer->hashed[i] = 1;
+    }
+  }
+}
+
+/* Records the hashes that were computed. Only inputs that weren't modified
+ * while they were read, and not too recently either, are cached. */
+static void store_cached_hashes (PUPWriter *writer)
+{
+  PUPHashCacheEntry before, after;
+  struct stat stat_buf;
+  unsigned int i;
+  time_t now_sec = time (NULL);
+
+  for (i = 0; writer->cache && i < writer->header.file_count; i++) {
+    if (writer->hashed[i] || writer->input_paths[i] == NULL ||
+        !S_ISREG (writer->input_stats[i].st_mode) ||
+        strchr (writer->input_paths[i], '\n') != NULL)
+      continue;
+
+    if (fstat (fileno (writer->inputs[i]), &stat_buf) != 0)
+      continue;
+    stat_to_cache_entry (&writer->input_stats[i], &before);
+    stat_to_cache_entry (&stat_buf, &after);
+    if (!cache_entry_matches (&before, &after) ||
+        after.size != writer->files[i].data_length ||
+        after.mtime_sec > now_sec - HASH_CACHE_RACY_SECONDS)
+      continue;
+
+    hash_cache_add (writer->cache, writer->input_paths[i], &after,
+        writer->hashes[i].hash);
+  }
+}
+
+
+PUPWriter *pup_writer_new (uint64_t image_version)
+{
+  PUPWriter *writer = calloc (1, sizeof(PUPWriter));
+
+  if (writer == NULL)
+    return NULL;
+
+  writer->header.magic = PUP_MAGIC;
+  writer->header.package_version = 1;
+  writer->header.image_version = image_version;
+  writer->header.header_length = sizeof(PUPHeader) + sizeof(PUPFooter);
+
+  return writer;
+}
+
+void pup_writer_set_threads (PUPWriter *writer, unsigned int threads)
+{
+  writer->threads = threads;
+}
+
+void pup_writer_set_hash_cache (PUPWriter *writer, PUPHashCache *cache)
+{
+  writer->cache = cache;
+}
+
+void pup_writer_free (PUPWriter *writer)
+{
+  unsigned int i;
+
+  if (writer == NULL)
+    return;
+
+  for (i = 0; i < MAX_ENTRIES; i++) {
+    if (writer->inputs[i])
+      fclose (writer->inputs[i]);
+    if (writer->input_maps[i])
+      munmap ((void *) writer->input_maps[i], writer->input_sizes[i]);
+    free (writer->input_paths[i]);
+  }
+  free (writer->files);
+  free (writer->hashes);
+  free (writer);
+}
+
+int pup_writer_add_file (PUPWriter *writer, uint64_t entry_id,
+    const char *path)
+{
+  unsigned int count = writer->header.file_count;
+  PUPFileEntry *files;
+  PUPHashEntry *hashes;
+
+  if (count >= MAX_ENTRIES)
+    return PUP_ERROR_INVALID;
+
+  writer->inputs[count] = fopen (path, "rb");
+  if (writer->inputs[count] == NULL)
+    return PUP_ERROR_OPEN;
+
+  /* Identifies the input in the hash cache */
+  if (fstat (fileno (writer->inputs[count]), &writer->input_stats[count]) != 0)
+    memset (&writer->input_stats[count], 0, sizeof(struct stat));
+  free (writer->input_paths[count]);
+  writer->input_paths[count] = realpath (path, NULL);
+
+  files = realloc (writer->files, sizeof(PUPFileEntry) * (count + 1));
+  if (files)
+    writer->files = files;
+  hashes = realloc (writer->hashes, sizeof(PUPHashEntry) * (count + 1));
+  if (hashes)
+    writer->hashes = hashes;
+  if (files == NULL || hashes == NULL) {
+    fclose (writer->inputs[count]);
+    writer->inputs[count] = NULL;
+    return PUP_ERROR_NO_MEMORY;
+  }
+
+  memset (&writer->files[count], 0, sizeof(PUPFileEntry));
+  memset (&writer->hashes[count], 0, sizeof(PUPHashEntry));
+
+  writer->hashes[count].entry_id = count;
+  writer->files[count].entry_id = entry_id;
+
+  writer->header.file_count++;
+  writer->header.header_length += sizeof(PUPFileEntry) + sizeof(PUPHashEntry);
+
+  return PUP_OK;
+}
+
+/* Batch HMAC of the inputs that were mapped */
+static void hash_mapped_inputs (PUPWriter *writer)
+{
+  const uint8_t *addr[MAX_ENTRIES];
+  size_t len[MAX_ENTRIES];
+  uint8_t macs[MAX_ENTRIES][PUP_HASH_LEN];
+  unsigned int index[MAX_ENTRIES];
+  unsigned int batch = 0;
+  unsigned int i;
+
+  for (i = 0; i < writer->header.file_count; i++) {
+    if (writer->input_maps[i] == NULL || writer->hashed[i])
+      continue;
+    addr[batch] = writer->input_maps[i];
+    len[batch] = writer->input_sizes[i];
+    index[batch++] = i;
+  }
+  if (batch == 0)
+    return;
+
+  hmac_sha1_multi_keyed (&pup_key, batch, addr, len, macs[0]);
+  for (i = 0; i < batch; i++)
+    memcpy (writer->hashes[index[i]].hash, macs[i], PUP_HASH_LEN);
+}
+
+static int pwrite_all (int fd, const uint8_t *data, uint64_t len,
+    uint64_t offset)
+{
+  ssize_t written;
+
+  while (len > 0) {
+    written = pwrite (fd, data, len > SSIZE_MAX ? SSIZE_MAX : len, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return 0;
+    data += written;
+    len -= written;
+    offset += written;
+  }
+
+  return 1;
+}
+
+/* Fills in the footer and writes the header, file and hash tables and the
+ * footer at the start of the output, once all the entries are known. */
+static int write_tables (PUPWriter *writer, int out)
+{
+  PUPHeader *header = &writer->header;
+  uint8_t *tables = NULL;
+  PUPHeader *orig_header;
+  PUPFileEntry *orig_files;
+  PUPHashEntry *orig_hashes;
+  HMAC_CTX context;
+  unsigned int i;
+  int error = PUP_OK;
+
+  tables = calloc (1, header->header_length);
+  if (tables == NULL)
+    return PUP_ERROR_NO_MEMORY;
+
+  orig_header = (PUPHeader *) tables;
+  orig_files = (PUPFileEntry *) (orig_header + 1);
+  orig_hashes = (PUPHashEntry *) (orig_files + header->file_count);
+
+  orig_header->magic = htonll (header->magic);
+  orig_header->package_version = htonll (header->package_version);
+  orig_header->image_version = htonll (header->image_version);
+  orig_header->file_count = htonll (header->file_count);
+  orig_header->header_length = htonll (header->header_length);
+  orig_header->data_length = htonll (header->data_length);
+
+  for (i = 0; i < header->file_count; i++) {
+    orig_files[i] = writer->files[i];
+    orig_files[i].entry_id = htonll (writer->files[i].entry_id);
+    orig_files[i].data_offset = htonll (writer->files[i].data_offset);
+    orig_files[i].data_length = htonll (writer->files[i].data_length);
+    orig_hashes[i] = writer->hashes[i];
+    orig_hashes[i].entry_id = htonll (writer->hashes[i].entry_id);
+  }
+
+  memset (&writer->footer, 0, sizeof(PUPFooter));
+  HMACInitKeyed (&context, &pup_key);
+  HMACUpdate64 (&context, tables, header->header_length - sizeof(PUPFooter));
+  HMACFinal (writer->footer.hash, &context);
+  memcpy (tables + header->header_length - sizeof(PUPFooter), &writer->footer,
+      sizeof(PUPFooter));
+
+  if (!pwrite_all (out, tables, header->header_length, 0))
+    error = PUP_ERROR_WRITE;
+
+  free (tables);
+
+  return error;
+}
+
+typedef struct {
+  PUPWriter *writer;
+  int out;
+  int error;
+  int error_errno;
+} WriteJob;
+
+/* Hashes one input and writes it at its final offset. Runs in a worker
+ * thread, each job only touches its own entry. */
+static void write_mapped_input (void *data, unsigned int index)
+{
+  WriteJob *job = (WriteJob *) data + index;
+  PUPWriter *writer = job->writer;
+  const PUPFileEntry *file = &writer->files[index];
+
+  if (!writer->hashed[index])
+    pup_hash (writer->input_maps[index], file->data_length,
+        writer->hashes[index].hash);
+
+  if (!pwrite_all (job->out, writer->input_maps[index], file->data_length,
+          file->data_offset)) {
+    job->error = PUP_ERROR_WRITE;
+    job->error_errno = errno;
+  }
+}
+
+/* Maps every input, which gives all the entry sizes and so all the final
+ * offsets up front. Returns 0 if any input can't be mapped, the caller then
+ * has to copy them in order instead. */
+static int map_inputs (PUPWriter *writer)
+{
+  PUPHeader *header = &writer->header;
+  struct stat stat_buf;
+  unsigned int i;
+
+  header->data_length = 0;
+  for (i = 0; i < header->file_count; i++) {
+    if (fstat (fileno (writer->inputs[i]), &stat_buf) != 0 ||
+        !S_ISREG (stat_buf.st_mode))
+      goto unmap;
+
+    /* Empty files can't be mapped but don't need to be either */
+    writer->input_sizes[i] = 0;
+    if (stat_buf.st_size > 0) {
+      writer->input_maps[i] = map_file (writer->inputs[i],
+          &writer->input_sizes[i]);
+      if (writer->input_maps[i] == NULL)
+        goto unmap;
+    }
+
+    writer->files[i].data_offset = header->header_length + header->data_length;
+    writer->files[i].data_length = writer->input_sizes[i];
+    header->data_length += writer->input_sizes[i];
+  }
+
+  return 1;
+
+ unmap:
+  for (i = 0; i < header->file_count; i++) {
+    if (writer->input_maps[i])
+      munmap ((void *) writer->input_maps[i], writer->input_sizes[i]);
+    writer->input_maps[i] = NULL;
+  }
+
+  return 0;
+}
+
+/* All the entries are hashed and written at the same time by the worker
+ * pool, with pwrite () at their final offsets, so the output is the same
+ * as what the sequential path produces. */
+static int write_parallel (PUPWriter *writer, int out)
+{
+  WriteJob *jobs;
+  unsigned int i;
+  int error = PUP_OK;
+
+  jobs = calloc (writer->header.file_count, sizeof(WriteJob));
+  if (jobs == NULL)
+    return PUP_ERROR_NO_MEMORY;
+
+  for (i = 0; i < writer->header.file_count; i++) {
+    jobs[i].writer = writer;
+    jobs[i].out = out;
+  }
+
+  pup_run_parallel (writer->header.file_count, writer->threads,
+      write_mapped_input, jobs);
+
+  for (i = 0; i < writer->header.file_count; i++) {
+    if (jobs[i].error != PUP_OK) {
+      error = jobs[i].error;
+      errno = jobs[i].error_errno;
+      break;
+    }
+  }
+  free (jobs);
+
+  return error;
+}
+
+/* Output is written in a single pass: the header size only depends on the
+ * number of entries, so the data region is written first, each input being
+ * hashed while it's copied, and the header, hash table and footer are
+ * filled in at the end. */
+static int write_sequential (PUPWriter *writer, FILE *out)
+{
+  PUPHeader *header = &writer->header;
+  PUPFileEntry *files = writer->files;
+  PUPHashEntry *hashes = writer->hashes;
+  char buffer[64 * 1024];
+  PUPHashContext context;
+  size_t read;
+  unsigned int i;
+
+  if (fseeko (out, header->header_length, SEEK_SET) != 0)
+    return PUP_ERROR_WRITE;
+
+  header->data_length = 0;
+  for (i = 0; i < header->file_count; i++) {
+    PUPFileEntry *file = &files[i];
+
+    file->data_offset = header->header_length + header->data_length;
+    file->data_length = 0;
+
+    /* Mapped inputs are copied now and hashed together at the end */
+    if (sha1_multi_lanes () > 1)
+      writer->input_maps[i] = map_file (writer->inputs[i],
+          &writer->input_sizes[i]);
+    if (writer->input_maps[i]) {
+      if (fwrite (writer->input_maps[i], 1, writer->input_sizes[i], out) <
+          writer->input_sizes[i])
+        return PUP_ERROR_WRITE;
+      file->data_length = writer->input_sizes[i];
+      header->data_length += file->data_length;
+      continue;
+    }
+
+    pup_hash_init (&context);
+    do {
+      read = fread (buffer, 1, sizeof(buffer), writer->inputs[i]);
+      if (read == 0)
+        break;
+
+      if (!writer->hashed[i])
+        pup_hash_update (&context, buffer, read);
+
+      if (fwrite (buffer, 1, read, out) < read)
+        return PUP_ERROR_WRITE;
+
+      file->data_length += read;
+    } while (!feof (writer->inputs[i]));
+
+    if (ferror (writer->inputs[i]))
+      return PUP_ERROR_READ;
+
+    if (!writer->hashed[i])
+      pup_hash_final (&context, hashes[i].hash);
+
+    header->data_length += file->data_length;
+  }
+
+  hash_mapped_inputs (writer);
+
+  if (fflush (out) != 0)
+    return PUP_ERROR_WRITE;
+
+  return PUP_OK;
+}
+
+/* Same as write_sequential () but the inputs go through the ring, which
+ * reads ahead and writes behind while each chunk is hashed. Returns 0 if an
+ * input isn't a regular file, before anything is written. */
+static int write_uring (PUPWriter *writer, URing *ring, int out, int *error)
+{
+  PUPHeader *header = &writer->header;
+  PUPHashContext context;
+  struct stat stat_buf;
+  unsigned int i;
+  int ret;
+
+  header->data_length = 0;
+  for (i = 0; i < header->file_count; i++) {
+    if (fstat (fileno (writer->inputs[i]), &stat_buf) != 0 ||
+        !S_ISREG (stat_buf.st_mode))
+      return 0;
+    writer->files[i].data_offset = header->header_length + header->data_length;
+    writer->files[i].data_length = stat_buf.st_size;
+    header->data_length += stat_buf.st_size;
+  }
+
+  *error = PUP_OK;
+  for (i = 0; i < header->file_count; i++) {
+    pup_hash_init (&context);
+    ret = uring_copy (ring, fileno (writer->inputs[i]), 0, out,
+        writer->files[i].data_offset, writer->files[i].data_length,
+        writer->hashed[i] ? skip_chunk : hash_chunk, &context);
+    if (ret != URING_OK) {
+      *error = ret == URING_ERROR_READ ? PUP_ERROR_READ : PUP_ERROR_WRITE;
+      break;
+    }
+    if (!writer->hashed[i])
+      pup_hash_final (&context, writer->hashes[i].hash);
+  }
+
+  return 1;
+}
+
+int pup_writer_write (PUPWriter *writer, const char *dest)
+{
+  FILE *out = NULL;
+  URing *ring;
+  unsigned int i;
+  int error = PUP_OK;
+  int saved_errno;
+
+  out = fopen (dest, "wb");
+  if (out == NULL) {
+    error = PUP_ERROR_OPEN;
+    goto done;
+  }
+
+  lookup_cached_hashes (writer);
+
+  if (writer->threads > 1 && writer->header.file_count > 1 &&
+      map_inputs (writer)) {
+    error = write_parallel (writer, fileno (out));
+  } else {
+    ring = uring_new (URING_DEPTH, URING_CHUNK_SIZE);
+    if (ring == NULL || !write_uring (writer, ring, fileno (out), &error))
+      error = write_sequential (writer, out);
+    uring_free (ring);
+  }
+
+  if (error == PUP_OK)
+    store_cached_hashes (writer);
+
+  if (error == PUP_OK)
+    error = write_tables (writer, fileno (out));
+
+ done:
+  saved_errno = errno;
+  for (i = 0; i < MAX_ENTRIES; i++) {
+    if (writer->inputs[i])
+      fclose (writer->inputs[i]);
+    writer->inputs[i] = NULL;
+    if (writer->input_maps[i])
+      munmap ((void *) writer->input_maps[i], writer->input_sizes[i]);
+    writer->input_maps[i] = NULL;
+  }
+  if (out && fclose (out) != 0 && error == PUP_OK) {
+    saved_errno = errno;
+    error = PUP_ERROR_WRITE;
+  }
+  errno = saved_errno;
+
+  return error;
+}
+
+/* Building a PUP from an archive stream. Members are hashed as they are
+ * read and kept in memory while they are small. A large member is written
+ * straight to the output, at the offset it will have if no other member
+ * follows it, which is the common case of update_files.tar coming last.
+ * Anything that doesn't fit either way is spilled to an unlinked temporary
+ * file next to the output, and only those spilled members are copied again,
+ * with copy_file_range (), when the output is put together. */
+#define ARCHIVE_MEMORY_LIMIT (64 * 1024 * 1024)
+#define ARCHIVE_CHUNK_SIZE (1024 * 1024)
+#define ARCHIVE_MAX_LONG_NAME (64 * 1024)
+
+#define CPIO_HEADER_SIZE 110
+
+typedef struct {
+  int present;
+  uint64_t size;
+  uint8_t *data;
+  int fd;
+  uint64_t offset;
+  uint8_t hash[PUP_HASH_LEN];
+} ArchiveEntry;
+
+typedef struct {
+  int in;
+  int cpio;
+  int out;
+  int spill;
+  uint64_t spill_size;
+  char *dir;
+  /* Entry written to the output, and whether it's still where it belongs */
+  int direct;
+  int out_is_spill;
+  unsigned int count;
+  uint64_t buffered;
+  uint64_t data_length;
+  ArchiveEntry entries[MAX_ENTRIES];
+  uint8_t *chunk;
+  /* Bytes already read to tell the format apart */
+  uint8_t magic[6];
+  unsigned int magic_len;
+} ArchiveStream;
+
+static int read_full (int fd, uint8_t *data, uint64_t len)
+{
+  ssize_t got;
+
+  while (len > 0) {
+    got = read (fd, data, len > SSIZE_MAX ? SSIZE_MAX : len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      if (got == 0)
+        errno = EIO;
+      return 0;
+    }
+    data += got;
+    len -= got;
+  }
+
+  return 1;
+}
+
+static int read_input (ArchiveStream *stream, uint8_t *data, uint64_t len)
+{
+  unsigned int size = 0;
+
+  if (stream->magic_len > 0) {
+    size = len < stream->magic_len ? len : stream->magic_len;
+    memcpy (data, stream->magic, size);
+    memmove (stream->magic, stream->magic + size, stream->magic_len - size);
+    stream->magic_len -= size;
+  }
+
+  return read_full (stream->in, data + size, len - size);
+}
+
+static int skip_input (ArchiveStream *stream, uint64_t len)
+{
+  uint64_t size;
+
+  while (len > 0) {
+    size = len > ARCHIVE_CHUNK_SIZE ? ARCHIVE_CHUNK_SIZE : len;
+    if (!read_input (stream, stream->chunk, size))
+      return 0;
+    len -= size;
+  }
+
+  return 1;
+}
+
+/* Copies within or between files without going through user space when the
+ * kernel and filesystem allow it */
+static int copy_range (int in_fd, uint64_t in_offset, int out_fd,
+    uint64_t out_offset, uint64_t len, uint8_t *buffer)
+{
+  loff_t in_pos = in_offset;
+  loff_t out_pos = out_offset;
+  uint64_t size;
+  ssize_t copied;
+
+  while (len > 0) {
+    copied = copy_file_range (in_fd, &in_pos, out_fd, &out_pos,
+        len > SSIZE_MAX ? SSIZE_MAX : len, 0);
+    if (copied < 0 && errno == EINTR)
+      continue;
+    if (copied < 0 && (errno == EXDEV || errno == EINVAL ||
+            errno == ENOSYS || errno == EOPNOTSUPP))
+      break;
+    if (copied <= 0) {
+      if (copied == 0)
+        errno = EIO;
+      return 0;
+    }
+    len -= copied;
+  }
+
+  while (len > 0) {
+    size = len > ARCHIVE_CHUNK_SIZE ? ARCHIVE_CHUNK_SIZE : len;
+    copied = pread (in_fd, buffer, size, in_pos);
+    if (copied < 0 && errno == EINTR)
+      continue;
+    if (copied <= 0) {
+      if (copied == 0)
+        errno = EIO;
+      return 0;
+    }
+    if (!pwrite_all (out_fd, buffer, copied, out_pos))
+      return 0;
+    in_pos += copied;
+    out_pos += copied;
+    len -= copied;
+  }
+
+  return 1;
+}
+
+/* Unlinked temporary file in the output's directory, so the spilled data
+ * stays on the same filesystem and can be reflinked */
+static int open_spill_file (const char *dir)
+{
+  char *template;
+  int fd;
+
+  fd = open (dir, O_TMPFILE | O_RDWR, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+
+  template = malloc (strlen (dir) + sizeof("/.pup-spill-XXXXXX"));
+  if (template == NULL)
+    return -1;
+  sprintf (template, "%s/.pup-spill-XXXXXX", dir);
+  fd = mkstemp (template);
+  if (fd >= 0)
+    unlink (template);
+  free (template);
+
+  return fd;
+}
+
+static uint64_t archive_header_length (unsigned int count)
+{
+  return sizeof(PUPHeader) + sizeof(PUPFooter) +
+      count * (sizeof(PUPFileEntry) + sizeof(PUPHashEntry));
+}
+
+/* Index in pup_entries[] of the entry named like the member's file name,
+ * whatever directory it's in, or -1 */
+static int archive_entry_index (const char *name)
+{
+  const char *filename = strrchr (name, '/');
+  unsigned int i;
+
+  filename = filename ? filename + 1 : name;
+  for (i = 0; pup_entries[i].id; i++) {
+    if (strcmp (pup_entries[i].filename, filename) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+/* The member written to the output isn't the last one after all, the
+ * output now only serves as a spill file and has to be rebuilt at the end */
+static void archive_demote_direct (ArchiveStream *stream)
+{
+  if (stream->direct < 0)
+    return;
+
+  stream->out_is_spill = 1;
+  stream->direct = -1;
+}
+
+static int archive_read_member (ArchiveStream *stream, unsigned int index,
+    uint64_t size)
+{
+  ArchiveEntry *entry = &stream->entries[index];
+  PUPHashContext context;
+  uint64_t done = 0;
+  uint64_t len;
+  unsigned int i;
+  int direct = 1;
+
+  archive_demote_direct (stream);
+
+  entry->size = size;
+  entry->fd = -1;
+  if (stream->buffered + size <= ARCHIVE_MEMORY_LIMIT) {
+    entry->data = malloc (size ? size : 1);
+    if (entry->data == NULL)
+      return PUP_ERROR_NO_MEMORY;
+    stream->buffered += size;
+  } else {
+    /* Goes straight to the output if every entry seen so far comes before
+     * it. Once the output holds data out of place, everything else spills. */
+    for (i = index + 1; i < MAX_ENTRIES; i++) {
+      if (stream->entries[i].present)
+        direct = 0;
+    }
+    if (direct && !stream->out_is_spill) {
+      entry->fd = stream->out;
+      entry->offset = archive_header_length (stream->count + 1) +
+          stream->data_length;
+      stream->direct = index;
+    } else {
+      if (stream->spill < 0)
+        stream->spill = open_spill_file (stream->dir);
+      if (stream->spill < 0)
+        return PUP_ERROR_OPEN;
+      entry->fd = stream->spill;
+      entry->offset = stream->spill_size;
+      stream->spill_size += size;
+    }
+  }
+
+  pup_hash_init (&context);
+  while (done < size) {
+    len = size - done > ARCHIVE_CHUNK_SIZE ? ARCHIVE_CHUNK_SIZE : size - done;
+    if (entry->data) {
+      if (!read_input (stream, entry->data + done, len))
+        return PUP_ERROR_READ;
+      pup_hash_update (&context, entry->data + done, len);
+    } else {
+      if (!read_input (stream, stream->chunk, len))
+        return PUP_ERROR_READ;
+      pup_hash_update (&context, stream->chunk, len);
+      if (!pwrite_all (entry->fd, stream->chunk, len, entry->offset + done))
+        return PUP_ERROR_WRITE;
+    }
+    done += len;
+  }
+  pup_hash_final (&context, entry->hash);
+
+  entry->present = 1;
+  stream->count++;
+  stream->data_length += size;
+
+  return PUP_OK;
+}
+
+/* Reads the next regular file of a tar or cpio (newc) archive into member.
+ * Returns 1 for a member, 0 at the end of the archive. */
+static int archive_next_member (ArchiveStream *stream, TARMember *member,
+    int *error)
+{
+  uint8_t block[TAR_BLOCK_SIZE];
+  TARMember long_name;
+  uint8_t *long_name_data = NULL;
+  char field[9];
+  uint64_t values[13];
+  uint64_t name_size;
+  unsigned int i;
+  int ret;
+
+  *error = PUP_OK;
+  while (stream->cpio) {
+    if (!read_input (stream, block, CPIO_HEADER_SIZE))
+      goto read_error;
+    if (memcmp (block, "070701", 6) != 0 && memcmp (block, "070702", 6) != 0)
+      goto invalid;
+
+    field[8] = '\0';
+    for (i = 0; i < 13; i++) {
+      memcpy (field, block + 6 + i * 8, 8);
+      values[i] = strtoull (field, NULL, 16);
+    }
+    member->size = values[6];
+    name_size = values[11];
+    if (name_size == 0 || name_size > sizeof(member->name))
+      goto invalid;
+
+    /* The name is padded so that the data starts on 4 bytes */
+    if (!read_input (stream, (uint8_t *) member->name, name_size) ||
+        !skip_input (stream, (4 - (CPIO_HEADER_SIZE + name_size) % 4) % 4))
+      goto read_error;
+    member->name[name_size - 1] = '\0';
+
+    if (strcmp (member->name, "TRAILER!!!") == 0)
+      return 0;
+
+    if ((values[1] & 0170000) == 0100000)
+      return 1;
+
+    if (!skip_input (stream, member->size + (4 - member->size % 4) % 4))
+      goto read_error;
+  }
+
+  while (1) {
+    if (!read_input (stream, block, TAR_BLOCK_SIZE))
+      goto read_error;
+
+    ret = tar_parse_header (block, member);
+    if (ret == 0) {
+      free (long_name_data);
+      return 0;
+    } else if (ret < 0) {
+      goto invalid;
+    }
+
+    if (member->type == 'L' || member->type == 'x') {
+      if (member->size > ARCHIVE_MAX_LONG_NAME)
+        goto invalid;
+      free (long_name_data);
+      long_name_data = malloc (TAR_PADDED_SIZE (member->size) + 1);
+      if (long_name_data == NULL) {
+        *error = PUP_ERROR_NO_MEMORY;
+        return -1;
+      }
+      if (!read_input (stream, long_name_data,
+              TAR_PADDED_SIZE (member->size)))
+        goto read_error;
+      long_name = *member;
+      continue;
+    }
+    if (long_name_data) {
+      tar_apply_long_name (&long_name, long_name_data, member);
+      free (long_name_data);
+      long_name_data = NULL;
+    }
+
+    if (member->type == '0' || member->type == '\0' || member->type == '7')
+      return 1;
+
+    if (!skip_input (stream, TAR_PADDED_SIZE (member->size)))
+      goto read_error;
+  }
+
+ read_error:
+  free (long_name_data);
+  *error = PUP_ERROR_READ;
+  return -1;
+
+ invalid:
+  free (long_name_data);
+  *error = PUP_ERROR_INVALID;
+  return -1;
+}
+
+/* Writes the entries that aren't already in place, and the tables, to out */
+static int archive_assemble (PUPWriter *writer, ArchiveStream *stream,
+    int out)
+{
+  PUPHeader *header = &writer->header;
+  ArchiveEntry *entry;
+  PUPFileEntry *file;
+  unsigned int count = 0;
+  unsigned int i;
+
+  writer->files = calloc (stream->count + 1, sizeof(PUPFileEntry));
+  writer->hashes = calloc (stream->count + 1, sizeof(PUPHashEntry));
+  if (writer->files == NULL || writer->hashes == NULL)
+    return PUP_ERROR_NO_MEMORY;
+
+  header->file_count = stream->count;
+  header->header_length = archive_header_length (stream->count);
+  header->data_length = 0;
+
+  for (i = 0; pup_entries[i].id; i++) {
+    entry = &stream->entries[i];
+    if (!entry->present)
+      continue;
+
+    file = &writer->files[count];
+    file->entry_id = pup_entries[i].id;
+    file->data_offset = header->header_length + header->data_length;
+    file->data_length = entry->size;
+    writer->hashes[count].entry_id = count;
+    memcpy (writer->hashes[count].hash, entry->hash, PUP_HASH_LEN);
+    header->data_length += entry->size;
+    count++;
+
+    if (entry->data) {
+      if (!pwrite_all (out, entry->data, entry->size, file->data_offset))
+        return PUP_ERROR_WRITE;
+    } else if (entry->fd != out || entry->offset != file->data_offset) {
+      if (!copy_range (entry->fd, entry->offset, out, file->data_offset,
+              entry->size, stream->chunk))
+        return PUP_ERROR_WRITE;
+    }
+  }
+
+  return write_tables (writer, out);
+}
+
+int pup_writer_write_archive (PUPWriter *writer, int in, const char *dest)
+{
+  ArchiveStream stream;
+  TARMember *member = NULL;
+  char *tmp_path = NULL;
+  char *slash;
+  int out = -1;
+  mode_t mask;
+  int index;
+  unsigned int i;
+  int ret;
+  int error = PUP_OK;
+  int saved_errno;
+
+  if (writer->header.file_count != 0)
+    return PUP_ERROR_INVALID;
+
+  memset (&stream, 0, sizeof(stream));
+  stream.in = in;
+  stream.out = -1;
+  stream.spill = -1;
+  stream.direct = -1;
+
+  stream.chunk = malloc (ARCHIVE_CHUNK_SIZE);
+  member = malloc (sizeof(TARMember));
+  stream.dir = strdup (dest);
+  if (stream.chunk == NULL || member == NULL || stream.dir == NULL) {
+    error = PUP_ERROR_NO_MEMORY;
+    goto done;
+  }
+  slash = strrchr (stream.dir, '/');
+  if (slash == stream.dir)
+    slash[1] = '\0';
+  else if (slash)
+    *slash = '\0';
+  else
+    strcpy (stream.dir, ".");
+
+  stream.out = open (dest, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (stream.out < 0) {
+    error = PUP_ERROR_OPEN;
+    goto done;
+  }
+
+  /* cpio archives start with their magic, anything else has to be tar */
+  if (!read_full (in, stream.magic, sizeof(stream.magic))) {
+    error = PUP_ERROR_READ;
+    goto done;
+  }
+  stream.magic_len = sizeof(stream.magic);
+  stream.cpio = memcmp (stream.magic, "070701", 6) == 0 ||
+      memcmp (stream.magic, "070702", 6) == 0;
+
+  while ((ret = archive_next_member (&stream, member, &error)) > 0) {
+    index = archive_entry_index (member->name);
+    if (index < 0) {
+      /* Not an entry, skip over it */
+      if (!skip_input (&stream, stream.cpio ?
+              member->size + (4 - member->size % 4) % 4 :
+              TAR_PADDED_SIZE (member->size))) {
+        error = PUP_ERROR_READ;
+        goto done;
+      }
+      continue;
+    }
+    if (stream.entries[index].present) {
+      error = PUP_ERROR_INVALID;
+      goto done;
+    }
+
+    error = archive_read_member (&stream, index, member->size);
+    if (error != PUP_OK)
+      goto done;
+
+    if (!skip_input (&stream, stream.cpio ? (4 - member->size % 4) % 4 :
+            TAR_PADDED_SIZE (member->size) - member->size)) {
+      error = PUP_ERROR_READ;
+      goto done;
+    }
+  }
+  if (ret < 0)
+    goto done;
+
+  /* The output holds data that isn't where it goes, so the PUP is put
+   * together in a new file which then replaces it */
+  out = stream.out;
+  if (stream.out_is_spill) {
+    tmp_path = malloc (strlen (dest) + sizeof(".XXXXXX"));
+    if (tmp_path == NULL) {
+      error = PUP_ERROR_NO_MEMORY;
+      goto done;
+    }
+    sprintf (tmp_path, "%s.XXXXXX", dest);
+    out = mkstemp (tmp_path);
+    if (out < 0) {
+      error = PUP_ERROR_OPEN;
+      goto done;
+    }
+  }
+
+  error = archive_assemble (writer, &stream, out);
+  if (error == PUP_OK && out != stream.out) {
+    mask = umask (0);
+    umask (mask);
+    if (fchmod (out, 0666 & ~mask) != 0 ||
+        rename (tmp_path, dest) != 0)
+      error = PUP_ERROR_WRITE;
+  }
+
+ done:
+  saved_errno = errno;
+  if (out >= 0 && out != stream.out) {
+    if (close (out) != 0 && error == PUP_OK) {
+      saved_errno = errno;
+      error = PUP_ERROR_WRITE;
+    }
+    if (error != PUP_OK)
+      unlink (tmp_path);
+  }
+  if (stream.out >= 0 && close (stream.out) != 0 && error == PUP_OK) {
+    saved_errno = errno;
+    error = PUP_ERROR_WRITE;
+  }
+  if (stream.spill >= 0)
+    close (stream.spill);
+  for (i = 0; i < MAX_ENTRIES; i++)
+    free (stream.entries[i].data);
+  free (member);
+  free (stream.chunk);
+  free (stream.dir);
+  free (tmp_path);
+  errno = saved_errno;
+
+  return error;
+}
+
+const PUPHeader *pup_writer_get_header (const PUPWriter *writer)
+{
+  return &writer->header;
+}
+
+const PUPFooter *pup_writer_get_footer (const PUPWriter *writer)
+{
+  return &writer->footer;
+}
+
+const PUPFileEntry *pup_writer_get_files (const PUPWriter *writer)
+{
+  return writer->files;
+}
+
+const PUPHashEntry *pup_writer_get_hashes (const PUPWriter *writer)
+{
+  return writer->hashes;
+}
@@ -0,0 +1,189 @@
+/*
+ * libpup.h -- PS3 PUP update file reader/writer library
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+#ifndef LIBPUP_H
+#define LIBPUP_H
+
+#include <stdint.h>
+
+#include "sha1.h"
+
+#define PUP_MAGIC (uint64_t) 0x5343455546000000  /* "SCEUF\0\0\0" */
+#define PUP_HASH_LEN SHA1_MAC_LEN
+
+/* On-disk layout of a PUP file, stored big endian. Everything returned by
+ * the library is already converted to host byte order. */
+typedef struct {
+  uint64_t magic;
+  uint64_t package_version;
+  uint64_t image_version;
+  uint64_t file_count;
+  uint64_t header_length;
+  uint64_t data_length;
+} PUPHeader;
+
+typedef struct {
+  uint64_t entry_id;
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint8_t padding[8];
+} PUPFileEntry;
+
+typedef struct {
+  uint64_t entry_id;
+  uint8_t hash[20];
+  uint8_t padding[4];
+} PUPHashEntry;
+
+typedef struct
+{
+  uint8_t hash[20];
+  uint8_t padding[12];
+} PUPFooter;
+
+typedef struct {
+  uint64_t id;
+  const char *filename;
+} PUPEntryID;
+
+/* Return values. For the OPEN/READ/WRITE errors errno is also set. */
+enum {
+  PUP_OK = 0,
+  PUP_ERROR_OPEN = -1,
+  PUP_ERROR_READ = -2,
+  PUP_ERROR_WRITE = -3,
+  PUP_ERROR_NO_MEMORY = -4,
+  PUP_ERROR_BAD_MAGIC = -5,
+  PUP_ERROR_HEADER_HASH = -6,
+  PUP_ERROR_FILE_HASH = -7,
+  PUP_ERROR_OUT_OF_BOUNDS = -8,
+  PUP_ERROR_INVALID = -9,
+  PUP_ERROR_NOT_SEEKABLE = -10,
+  PUP_ERROR_CANCELED = -11
+};
+
+const char *pup_strerror (int error);
+
+/* Known entries, terminated by an entry with an id of 0 */
+extern const PUPEntryID pup_entries[];
+
+const char *pup_id_to_filename (uint64_t entry_id);
+uint64_t pup_filename_to_id (const char *filename);
+
+/* Streaming HMAC of entry data with the PUP key */
+typedef struct {
+  HMAC_CTX context;
+} PUPHashContext;
+
+void pup_hash_init (PUPHashContext *context);
+void pup_hash_update (PUPHashContext *context, const void *data, uint64_t len);
+void pup_hash_final (PUPHashContext *context, uint8_t hash[PUP_HASH_LEN]);
+void pup_hash (const void *data, uint64_t len, uint8_t hash[PUP_HASH_LEN]);
+
+
+/* Runs func on every index in [0, count) using up to `jobs` threads, the
+ * calling thread included. Each index is handed out exactly once; func must
+ * only touch its own slot. */
+void pup_run_parallel (unsigned int count, unsigned int jobs,
+    void (*func) (void *data, unsigned int index), void *data);
+
+
+/* Reader. The file is mapped when possible, which gives zero-copy access
+ * to the entries, otherwise it's read through stdio. */
+typedef struct PUPFile PUPFile;
+
+/* On PUP_ERROR_HEADER_HASH the file is still returned so the tables can be
+ * inspected, it must be closed by the caller. pup_open_fd () takes
+ * ownership of fd, which may be a pipe: entries are then read in the order
+ * they are stored, skipping whatever lies between them. */
+int pup_open (const char *path, PUPFile **pup);
+int pup_open_fd (int fd, PUPFile **pup);
+void pup_close (PUPFile *pup);
+
+const PUPHeader *pup_get_header (const PUPFile *pup);
+const PUPFooter *pup_get_footer (const PUPFile *pup);
+const PUPFileEntry *pup_get_files (const PUPFile *pup);
+const PUPHashEntry *pup_get_hashes (const PUPFile *pup);
+void pup_get_header_hash (const PUPFile *pup, uint8_t hash[PUP_HASH_LEN]);
+uint64_t pup_get_size (const PUPFile *pup);
+
+/* Index of the entry with that id, or -1 */
+int pup_find_entry (const PUPFile *pup, uint64_t entry_id);
+
+/* Zero-copy view of an entry's data, only for mapped files */
+int pup_entry_data (const PUPFile *pup, unsigned int index,
+    const uint8_t **data);
+
+/* Hashes entries, and writes them out if a path is set, then checks the
+ * result against the hash table. With threads > 1 the entries of a mapped
+ * file are processed in parallel. Every job gets its own result, and the
+ * error of the first failed job, in array order, is returned.
+ * When the jobs run one after the other, stop_on_error checks each one as
+ * soon as it's done and leaves the ones after a failure with
+ * PUP_ERROR_CANCELED, so nothing more is written. */
+typedef struct {
+  unsigned int index;
+  const char *path;
+  uint8_t hash[PUP_HASH_LEN];
+  double elapsed;
+  int error;
+  int error_errno;
+} PUPEntryJob;
+
+int pup_run_jobs (PUPFile *pup, PUPEntryJob *jobs, unsigned int count,
+    unsigned int threads, int stop_on_error);
+
+/* Writes an entry to out_fd, with sendfile () when the kernel supports it
+ * for that output, and verifies its hash in the same pass. The data has
+ * already been written when PUP_ERROR_FILE_HASH is returned. */
+int pup_entry_send (PUPFile *pup, unsigned int index, int out_fd,
+    uint8_t hash[PUP_HASH_LEN]);
+
+
+/* Writer. Entries are written in the order they are added. */
+typedef struct PUPWriter PUPWriter;
+
+PUPWriter *pup_writer_new (uint64_t image_version);
+void pup_writer_free (PUPWriter *writer);
+int pup_writer_add_file (PUPWriter *writer, uint64_t entry_id,
+    const char *path);
+/* With threads > 1, and if all the inputs can be mapped, the entries are
+ * hashed and written in parallel. The output is identical either way. */
+void pup_writer_set_threads (PUPWriter *writer, unsigned int threads);
+int pup_writer_write (PUPWriter *writer, const char *dest);
+
+/* Builds the PUP from a tar or cpio (newc) archive read from in, on a
+ * writer that has no files added. Members are matched to entries by their
+ * file name, whatever directory they are in, the others are skipped. The
+ * entries are written in the same order as pup_entries[], so the output is
+ * the same as adding the extracted files in that order. */
+int pup_writer_write_archive (PUPWriter *writer, int in, const char *dest);
+
+/* Persistent cache of input hashes, keyed on the input's absolute path,
+ * device, inode, size and mtime, so unchanged inputs aren't hashed again.
+ * Loading a missing cache gives an empty one. Clearing it forces all the
+ * inputs to be hashed and replaces every entry when it's saved. */
+typedef struct PUPHashCache PUPHashCache;
+
+int pup_hash_cache_load (const char *path, PUPHashCache **cache);
+int pup_hash_cache_save (PUPHashCache *cache);
+void pup_hash_cache_clear (PUPHashCache *cache);
+void pup_hash_cache_free (PUPHashCache *cache);
+
+/* The cache is looked up and updated by pup_writer_write () */
+void pup_writer_set_hash_cache (PUPWriter *writer, PUPHashCache *cache);
+
+/* Tables of the PUP file, once written */
+const PUPHeader *pup_writer_get_header (const PUPWriter *writer);
+const PUPFooter *pup_writer_get_footer (const PUPWriter *writer);
+const PUPFileEntry *pup_writer_get_files (const PUPWriter *writer);
+const PUPHashEntry *pup_writer_get_hashes (const PUPWriter *writer);
+
+#endif /* LIBPUP_H */
@@ -8,117 +8,76 @@
  *
  */
 
+/* For nftw () */
+#define _XOPEN_SOURCE 700
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <ftw.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
-#include <arpa/inet.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
-#include "sha1.h"
+#include "libpup.h"
+#include "tar.h"
 
 #define VERSION "0.2"
 
-#define PUP_MAGIC (uint64_t) 0x5343455546000000  /* "SCEUF\0\0\0" */
-
-static const uint8_t hmac_pup_key[] = {
-  0xf4, 0x91, 0xad, 0x94, 0xc6, 0x81, 0x10, 0x96,
-  0x91, 0x5f, 0xd5, 0xd2, 0x44, 0x81, 0xae, 0xdc,
-  0xed, 0xed, 0xbe, 0x6b, 0xe5, 0x13, 0x72, 0x4d,
-  0xd8, 0xf7, 0xb6, 0x91, 0xe8, 0x8a, 0x38, 0xf4,
-  0xb5, 0x16, 0x2b, 0xfb, 0xec, 0xbe, 0x3a, 0x62,
-  0x18, 0x5d, 0xd7, 0xc9, 0x4d, 0xa2, 0x22, 0x5a,
-  0xda, 0x3f, 0xbf, 0xce, 0x55, 0x5b, 0x9e, 0xa9,
-  0x64, 0x98, 0x29, 0xeb, 0x30, 0xce, 0x83, 0x66
-};
-
-typedef struct {
-  uint64_t magic;
-  uint64_t package_version;
-  uint64_t image_version;
-  uint64_t file_count;
-  uint64_t header_length;
-  uint64_t data_length;
-} PUPHeader;
-
-typedef struct {
-  uint64_t entry_id;
-  uint64_t data_offset;
-  uint64_t data_length;
-  uint8_t padding[8];
-} PUPFileEntry;
-
-typedef struct {
-  uint64_t entry_id;
-  uint8_t hash[20];
-  uint8_t padding[4];
-} PUPHashEntry;
-
-typedef struct
-{
-  uint8_t hash[20];
-  uint8_t padding[12];
-} PUPFooter;
-
-#define ntohll(x) (((uint64_t) ntohl (x) << 32) | (uint64_t) ntohl (x >> 32) )
-#define htonll(x) (((uint64_t) htonl (x) << 32) | (uint64_t) htonl (x >> 32) )
-
 static void usage (const char *program)
 {
   fprintf (stderr, "Usage:\n\t%s <command> <options>\n\n"
       "Commands/Options:\n"
       "\ti <filename.pup>:\t\t\t\t\tInformation about the PUP file\n"
-      "\tx <filename.pup> <output directory>:\t\t\tExtract PUP file\n"
-      "\tc <input directory> <filename.pup> <build number>:\tCreate PUP file\n\n", program);
+      "\tx [-j jobs] [-e <entry id|filename>]... [-s store [-m]] <filename.pup> <output directory>:\n"
+      "\t\t\t\t\t\t\t\tExtract PUP file, or only the given entries\n"
+      "\tv [-j jobs] <filename.pup>:\t\t\t\tVerify PUP file hashes\n"
+      "\td [-t] <old.pup> <new.pup>:\t\t\t\tCompare the entries of two PUP files\n"
+      "\tcat <filename.pup> <entry id|filename>:\t\t\tWrite a PUP entry to stdout\n"
+      "\tc [-j jobs] [-C cache [-R]] <input directory> <filename.pup> <build number>:\n"
+      "\t\t\t\t\t\t\t\tCreate PUP file\n\n"
+      "\tcatalog [-j jobs] [-V] [-f jsonl|csv] <directory> <catalog file>:\n"
+      "\t\t\t\t\t\t\t\tCatalog all the .pup files in a tree\n\n"
+      "pup c -C <cache> reuses the hashes of unchanged inputs from the cache\n"
+      "file, -R hashes everything again and rewrites the cache.\n\n"
+      "The input directory of c can be - to read a tar or cpio archive of the\n"
+      "entries from stdin instead, -j, -C and -R don't apply to it.\n\n"
+      "The input PUP of i, x, v and cat can be - to read it from stdin.\n\n"
+      "pup x -s <store> writes the entries to a content-addressed store and\n"
+      "hardlinks them, read-only, in the output directory, -m stores the files\n"
+      "of tar entries one by one in <filename>.d instead.\n\n"
+      "pup d exits with 1 if the PUPs differ, -t also lists the files that\n"
+      "changed in the tar entries that changed.\n\n"
+      "pup catalog only scans the PUPs that changed since they were added to\n"
+      "the catalog file, and -V also verifies the hashes of their entries.\n"
+      "jsonl, the default, writes one JSON object per PUP and per line.\n\n",
+      program);
   exit (-1);
 }
 
-typedef struct {
-  uint64_t id;
-  const char *filename;
-} PUPEntryID;
-
-static const PUPEntryID entries[] = {
-  {0x100, "version.txt"},
-  {0x101, "license.xml"},
-  {0x102, "promo_flags.txt"},
-  {0x103, "update_flags.txt"},
-  {0x104, "patch_build.txt"},
-  {0x200, "ps3swu.self"},
-  {0x201, "vsh.tar"},
-  {0x202, "dots.txt"},
-  {0x203, "patch_data.pkg"},
-  {0x300, "update_files.tar"},
-  {0, NULL}
-};
-
-static const char *id_to_filename (uint64_t entry_id)
-{
-  const PUPEntryID *entry = entries;
-
-  while (entry->id) {
-    if (entry->id == entry_id)
-      return entry->filename;
-    entry++;
-  }
-  return NULL;
-}
-
-static void print_hash (const char *message, uint8_t hash[20])
+static void fprint_hash (FILE *out, const char *message, const uint8_t hash[20])
 {
   int i;
 
-  printf ("%s : ", message);
+  fprintf (out, "%s : ", message);
   for (i = 0; i < 20; i++) {
-    printf ("%.2X", hash[i]);
+    fprintf (out, "%.2X", hash[i]);
   }
-  printf ("\n");
+  fprintf (out, "\n");
 }
 
-static void print_header_info (PUPHeader *header, PUPFooter *footer)
+static void print_hash (const char *message, const uint8_t hash[20])
+{
+  fprint_hash (stdout, message, hash);
+}
+
+static void print_header_info (const PUPHeader *header,
+    const PUPFooter *footer)
 {
   printf ("PUP file information\n"
       "Package version: %llu\n"
@@ -132,11 +91,12 @@ static void print_header_info (PUPHeader *header, PUPFooter *footer)
   print_hash ("PUP file hash", footer->hash);
 }
 
-static void print_file_info ( PUPFileEntry *file, PUPHashEntry *hash)
+static void print_file_info (const PUPFileEntry *file,
+    const PUPHashEntry *hash)
 {
   const char *filename = NULL;
 
-  filename = id_to_filename (file->entry_id);
+  filename = pup_id_to_filename (file->entry_id);
 
   printf ("\tFile %d\n"
       "\tEntry id: 0x%X\n"
@@ -150,463 +110,1616 @@ static void print_file_info ( PUPFileEntry *file, PUPHashEntry *hash)
   print_hash ("File hash", hash->hash);
 }
 
-static int read_header (FILE *fd, PUPHeader *header,
-    PUPFileEntry **files, PUPHashEntry **hashes, PUPFooter *footer)
+/* Reports a libpup error, with the reason from errno when there is one */
+static void print_error (const char *message, int error, int error_errno)
 {
+  if (error == PUP_ERROR_OPEN || error == PUP_ERROR_READ ||
+      error == PUP_ERROR_WRITE)
+    fprintf (stderr, "%s: %s: %s\n", message, pup_strerror (error),
+        strerror (error_errno));
+  else
+    fprintf (stderr, "%s: %s\n", message, pup_strerror (error));
+}
 
-  PUPHeader orig_header;
-  HMAC_CTX context;
-  uint8_t hash[SHA1_MAC_LEN];
-  int read;
+static PUPFile *open_pup (const char *file)
+{
+  PUPFile *pup = NULL;
+  uint8_t hash[PUP_HASH_LEN];
+  int ret;
+
+  /* "-" reads the PUP from stdin, which may well be a pipe */
+  if (strcmp (file, "-") == 0)
+    ret = pup_open_fd (STDIN_FILENO, &pup);
+  else
+    ret = pup_open (file, &pup);
+  if (ret == PUP_ERROR_HEADER_HASH) {
+    fprintf (stderr, "PUP file is corrupted, wrong header hash\n\n");
+    pup_get_header_hash (pup, hash);
+    print_hash ("Header hash", hash);
+    print_hash ("Expected hash", pup_get_footer (pup)->hash);
+    pup_close (pup);
+    return NULL;
+  } else if (ret != PUP_OK) {
+    print_error ("Error opening input file", ret, errno);
+    return NULL;
+  }
+
+  return pup;
+}
+
+static void print_wrong_hash (const PUPEntryJob *job, const PUPHashEntry *hash)
+{
+  fprintf (stderr, "PUP file is corrupted, wrong file hash\n\n");
+  print_hash ("File hash", job->hash);
+  print_hash ("Expected hash", hash->hash);
+}
+
+static void info (const char *file)
+{
+  PUPFile *pup = NULL;
   unsigned int i;
 
-  *files = NULL;
-  *hashes = NULL;
+  pup = open_pup (file);
+  if (pup == NULL)
+    exit (-2);
+
+  print_header_info (pup_get_header (pup), pup_get_footer (pup));
 
-  read = fread (&orig_header, sizeof(PUPHeader), 1, fd);
+  for (i = 0; i < pup_get_header (pup)->file_count; i++)
+    print_file_info (&pup_get_files (pup)[i], &pup_get_hashes (pup)[i]);
 
-  if (read < 1) {
-    perror ("Couldn't read header");
-    goto error;
+  pup_close (pup);
+}
+
+
+static int is_selected (uint64_t entry_id, const uint64_t *selected,
+    unsigned int selected_count)
+{
+  unsigned int i;
+
+  for (i = 0; i < selected_count; i++) {
+    if (selected[i] == entry_id)
+      return 1;
   }
+  return 0;
+}
 
-  header->magic = ntohll(orig_header.magic);
-  header->package_version = ntohll(orig_header.package_version);
-  header->image_version = ntohll(orig_header.image_version);
-  header->file_count = ntohll(orig_header.file_count);
-  header->header_length = ntohll(orig_header.header_length);
-  header->data_length = ntohll(orig_header.data_length);
+static int is_tar_entry (uint64_t entry_id)
+{
+  const char *filename = pup_id_to_filename (entry_id);
+  size_t len = filename ? strlen (filename) : 0;
 
-  if (header->magic != PUP_MAGIC) {
-    fprintf (stderr, "Magic number is not the same 0x%X%X\n",
-        (uint32_t) (header->magic >> 32), (uint32_t) header->magic);
-    goto error;
+  return len > 4 && strcmp (filename + len - 4, ".tar") == 0;
+}
+
+/* Content-addressed store: every object is a file named after the hash of
+ * its content, <store>/pup/<xx>/<rest of the hash> for PUP entries (keyed on
+ * their HMAC from the hash table) and <store>/sha1/... for tar members, so
+ * identical data is only ever written once and extracted trees are made of
+ * hardlinks to the objects. Objects are written to <store>/tmp first and
+ * renamed into place once complete and verified. */
+static int make_dirs (const char *dir)
+{
+  char path[PATH_MAX + 1];
+  char *p;
+
+  if (snprintf (path, sizeof(path), "%s", dir) >= (int) sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+
+  for (p = path + 1; ; p++) {
+    if (*p != '/' && *p != '\0')
+      continue;
+    if (p[-1] != '/') {
+      char c = *p;
+
+      *p = '\0';
+      if (mkdir (path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 &&
+          errno != EEXIST)
+        return 0;
+      *p = c;
+    }
+    if (*p == '\0')
+      break;
   }
 
-  *files = malloc (header->file_count * sizeof(PUPFileEntry));
-  *hashes = malloc (header->file_count * sizeof(PUPHashEntry));
+  return 1;
+}
+
+static int store_object_path (const char *store, const char *kind,
+    const uint8_t hash[SHA1_MAC_LEN], char *path, size_t size)
+{
+  char hex[SHA1_MAC_LEN * 2 + 1];
+  int i;
 
-  read = fread (*files, sizeof(PUPFileEntry), header->file_count, fd);
+  for (i = 0; i < SHA1_MAC_LEN; i++)
+    sprintf (hex + i * 2, "%.2x", hash[i]);
 
-  if (read < 0 || (uint) read < header->file_count) {
-    perror ("Couldn't read file entries");
-    goto error;
+  if (snprintf (path, size, "%s/%s/%.2s", store, kind, hex) >= (int) size ||
+      !make_dirs (path))
+    return 0;
+  snprintf (path, size, "%s/%s/%.2s/%s", store, kind, hex, hex + 2);
+
+  return 1;
+}
+
+/* An object is only reused if its content still matches the hash it's
+ * named after, the PUP hash (an HMAC) for entries and a plain SHA-1 for
+ * archive members. Anything else, such as an object that was changed
+ * through one of its links, is written again. */
+static int store_has_object (const char *object, uint64_t size, int hmac,
+    const uint8_t hash[SHA1_MAC_LEN])
+{
+  uint8_t buffer[64 * 1024];
+  uint8_t object_hash[SHA1_MAC_LEN];
+  PUPHashContext hmac_context;
+  SHA1_CTX sha1_context;
+  struct stat stat_buf;
+  ssize_t len;
+  int fd;
+
+  fd = open (object, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat (fd, &stat_buf) != 0 || !S_ISREG (stat_buf.st_mode) ||
+      (uint64_t) stat_buf.st_size != size) {
+    close (fd);
+    return 0;
+  }
+
+  if (hmac)
+    pup_hash_init (&hmac_context);
+  else
+    SHA1Init (&sha1_context);
+  while ((len = read (fd, buffer, sizeof(buffer))) != 0) {
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      close (fd);
+      return 0;
+    }
+    if (hmac)
+      pup_hash_update (&hmac_context, buffer, len);
+    else
+      SHA1Update (&sha1_context, buffer, len);
   }
+  close (fd);
 
-  read = fread (*hashes, sizeof(PUPHashEntry), header->file_count, fd);
+  if (hmac)
+    pup_hash_final (&hmac_context, object_hash);
+  else
+    SHA1Final (object_hash, &sha1_context);
 
-  if (read < 0 || (uint) read < header->file_count) {
-    perror ("Couldn't read hash entries");
-    goto error;
+  return memcmp (object_hash, hash, SHA1_MAC_LEN) == 0;
+}
+
+/* Creates an empty temporary file for a new object */
+static int store_tmp_file (const char *store, char *path, size_t size)
+{
+  int fd;
+
+  if (snprintf (path, size, "%s/tmp", store) >= (int) size ||
+      !make_dirs (path))
+    return 0;
+  snprintf (path, size, "%s/tmp/objectXXXXXX", store);
+
+  fd = mkstemp (path);
+  if (fd < 0)
+    return 0;
+  close (fd);
+
+  return 1;
+}
+
+/* Moves a complete object into place. Objects are shared by every tree
+ * that links them, so they are made read-only, with the umask applied like
+ * for a plain extraction: editing an extracted file in place must not
+ * change them. */
+static int store_add_object (const char *tmp, const char *object)
+{
+  mode_t mask;
+
+  mask = umask (0);
+  umask (mask);
+
+  return chmod (tmp, 0444 & ~mask) == 0 && rename (tmp, object) == 0;
+}
+
+/* Member names end up as paths under the destination, so anything that
+ * could escape it is refused */
+static int is_safe_member_path (const char *name)
+{
+  const char *component = name;
+
+  if (name[0] == '/' || name[0] == '\0')
+    return 0;
+
+  while (*component) {
+    if (strncmp (component, "..", 2) == 0 &&
+        (component[2] == '/' || component[2] == '\0'))
+      return 0;
+    component = strchr (component, '/');
+    if (component == NULL)
+      break;
+    component++;
   }
 
-  read = fread (footer, sizeof(PUPFooter), 1, fd);
+  return 1;
+}
 
-  if (read < 1) {
-    perror ("Couldn't read footer");
-    goto error;
+static int write_object (const char *path, const uint8_t *data, uint64_t size)
+{
+  ssize_t written;
+  int fd;
+
+  fd = open (path, O_WRONLY | O_TRUNC);
+  if (fd < 0)
+    return 0;
+
+  while (size > 0) {
+    written = write (fd, data, size > SSIZE_MAX ? SSIZE_MAX : size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      close (fd);
+      return 0;
+    }
+    data += written;
+    size -= written;
   }
 
-  HMACInit (&context, hmac_pup_key, sizeof(hmac_pup_key));
-  HMACUpdate (&context, &orig_header, sizeof(PUPHeader));
-  HMACUpdate (&context, *files, header->file_count * sizeof(PUPFileEntry));
-  HMACUpdate (&context, *hashes, header->file_count * sizeof(PUPHashEntry));
-  HMACFinal (hash, &context);
+  return close (fd) == 0;
+}
 
-  if (memcmp (hash, footer->hash, SHA1_MAC_LEN) != 0) {
-    fprintf (stderr, "PUP file is corrupted, wrong header hash\n\n");
-    print_hash ("Header hash", hash);
-    print_hash ("Expected hash", footer->hash);
-    goto error;
+/* Stores every file of a tar entry as its own object, and links them under
+ * dir with the paths they have in the archive. */
+static int store_tar_members (const char *store, const uint8_t *data,
+    uint64_t size, const char *dir, unsigned int *stored, unsigned int *linked)
+{
+  TARReader reader;
+  TARMember member;
+  uint8_t hash[SHA1_MAC_LEN];
+  char object[PATH_MAX + 1];
+  char tmp[PATH_MAX + 1];
+  char path[PATH_MAX + 1];
+  char *slash;
+  size_t len;
+  int ret;
+
+  *stored = 0;
+  *linked = 0;
+
+  tar_reader_init (&reader, data, size);
+  while ((ret = tar_reader_next (&reader, &member)) > 0) {
+    if (!is_safe_member_path (member.name)) {
+      fprintf (stderr, "Skipping archive member %s\n", member.name);
+      continue;
+    }
+    if (snprintf (path, sizeof(path), "%s/%s", dir, member.name) >=
+        (int) sizeof(path)) {
+      errno = ENAMETOOLONG;
+      goto error;
+    }
+
+    if (member.type == '5') {
+      if (!make_dirs (path))
+        goto error;
+      continue;
+    }
+
+    slash = strrchr (path, '/');
+    *slash = '\0';
+    if (!make_dirs (path))
+      goto error;
+    *slash = '/';
+
+    len = member.size;
+    sha1_vector (1, &member.data, &len, hash);
+    if (!store_object_path (store, "sha1", hash, object, sizeof(object)))
+      goto error;
+
+    if (!store_has_object (object, member.size, 0, hash)) {
+      if (!store_tmp_file (store, tmp, sizeof(tmp)))
+        goto error;
+      if (!write_object (tmp, member.data, member.size) ||
+          !store_add_object (tmp, object)) {
+        unlink (tmp);
+        goto error;
+      }
+      (*stored)++;
+    } else {
+      (*linked)++;
+    }
+
+    if (link (object, path) != 0)
+      goto error;
   }
 
-  for (i = 0; i < header->file_count; i++) {
-    (*files)[i].entry_id = ntohll ((*files)[i].entry_id);
-    (*files)[i].data_offset = ntohll ((*files)[i].data_offset);
-    (*files)[i].data_length = ntohll ((*files)[i].data_length);
-    (*hashes)[i].entry_id = ntohll ((*hashes)[i].entry_id);
+  if (ret < 0) {
+    fprintf (stderr, "Archive is corrupted\n");
+    return 0;
   }
 
   return 1;
 
  error:
-  if (*files)
-    free (*files);
-  *files = NULL;
-  if (*hashes)
-    free (*hashes);
-  *hashes = NULL;
-
+  perror (member.name);
   return 0;
 }
 
-static void info (const char *file)
+/* If selected_count isn't 0, only the entries with those ids are read,
+ * hashed and written, everything else in the PUP is left untouched.
+ *
+ * With a store, entries are written to the store (see above) and linked in
+ * dest, and entries that are already in the store aren't read at all. With
+ * members, tar entries are verified and their files are stored one by one
+ * in a <filename>.d directory instead. */
+static void extract (const char *file, const char *dest, unsigned int jobs,
+    const uint64_t *selected, unsigned int selected_count,
+    const char *store, int members)
 {
-  FILE *fd = NULL;
-  int i;
-  PUPHeader header;
-  PUPFooter footer;
-  PUPFileEntry *files = NULL;
-  PUPHashEntry *hashes = NULL;
+  PUPFile *pup = NULL;
+  const PUPHeader *header;
+  const PUPFileEntry *files;
+  const PUPHashEntry *hashes;
+  PUPEntryJob *extract_jobs = NULL;
+  int *entry_jobs = NULL;
+  char (*filenames)[PATH_MAX+1] = NULL;
+  char (*objects)[PATH_MAX+1] = NULL;
+  char path[PATH_MAX+1];
+  const uint8_t *data;
+  unsigned int stored, linked;
+  unsigned int count = 0;
+  unsigned int i;
+  struct stat stat_buf;
 
-  fd = fopen (file, "rb");
+  if (stat (dest, &stat_buf) == 0) {
+    fprintf (stderr, "Destination directory must not exist\n");
+    goto error;
+  }
 
-  if (fd == NULL) {
-    perror ("Error opening input file");
-    exit (-2);
+  pup = open_pup (file);
+  if (pup == NULL)
+    goto error;
+
+  header = pup_get_header (pup);
+  files = pup_get_files (pup);
+  hashes = pup_get_hashes (pup);
+
+  print_header_info (header, pup_get_footer (pup));
+
+  for (i = 0; i < selected_count; i++) {
+    if (pup_find_entry (pup, selected[i]) < 0) {
+      fprintf (stderr, "Entry 0x%X not found in PUP file\n",
+          (uint32_t) selected[i]);
+      goto error;
+    }
+  }
+
+  if (mkdir (dest, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
+    perror ("Couldn't create output directory");
+    goto error;
   }
 
-  if (read_header (fd, &header, &files, &hashes, &footer) == 0)
+  extract_jobs = calloc (header->file_count + 1, sizeof(PUPEntryJob));
+  entry_jobs = calloc (header->file_count + 1, sizeof(int));
+  filenames = calloc (header->file_count + 1, sizeof(filenames[0]));
+  objects = calloc (header->file_count + 1, sizeof(objects[0]));
+  if (extract_jobs == NULL || entry_jobs == NULL || filenames == NULL ||
+      objects == NULL) {
+    perror ("Couldn't allocate extraction jobs");
     goto error;
+  }
+
+  for (i = 0; i < header->file_count; i++) {
+    const char *filename = pup_id_to_filename (files[i].entry_id);
+
+    entry_jobs[i] = -1;
+
+    if (selected_count > 0) {
+      if (!is_selected (files[i].entry_id, selected, selected_count))
+        continue;
+      /* Explicitly requested, so unknown ids are named after their id */
+      if (filename == NULL) {
+        snprintf (filenames[i], sizeof(filenames[0]), "%s/0x%X", dest,
+            (uint32_t) files[i].entry_id);
+        goto add_job;
+      }
+    }
+
+    if (filename == NULL)
+      continue;
+    snprintf (filenames[i], sizeof(filenames[0]), "%s/%s", dest, filename);
+  add_job:
+    extract_jobs[count].index = i;
+    extract_jobs[count].path = filenames[i];
+
+    if (store && members && is_tar_entry (files[i].entry_id)) {
+      /* Only verified, the members are stored afterwards */
+      if (pup_entry_data (pup, i, &data) != PUP_OK) {
+        fprintf (stderr, "Storing archive members needs a PUP file that "
+            "can be mapped\n");
+        goto error;
+      }
+      extract_jobs[count].path = NULL;
+    } else if (store) {
+      if (!store_object_path (store, "pup", hashes[i].hash, objects[i],
+              sizeof(objects[0]))) {
+        perror ("Couldn't create the store");
+        goto error;
+      }
+      if (store_has_object (objects[i], files[i].data_length, 1,
+              hashes[i].hash))
+        continue;
+      if (!store_tmp_file (store, path, sizeof(path))) {
+        perror ("Couldn't create the store");
+        goto error;
+      }
+      extract_jobs[count].path = strdup (path);
+      if (extract_jobs[count].path == NULL) {
+        perror ("Couldn't allocate memory");
+        unlink (path);
+        goto error;
+      }
+    }
 
-  print_header_info (&header, &footer);
+    entry_jobs[i] = count++;
+  }
+
+  /* Failures are reported below, in entry order. A single thread stops at
+   * the first one, like extracting entries one by one would. */
+  pup_run_jobs (pup, extract_jobs, count, jobs, 1);
+
+  for (i = 0; i < header->file_count; i++) {
+    PUPEntryJob *job = entry_jobs[i] < 0 ? NULL : &extract_jobs[entry_jobs[i]];
+
+    if (selected_count > 0 &&
+        !is_selected (files[i].entry_id, selected, selected_count))
+      continue;
+    /* Skipped after a failure, which a stream can meet before entries
+     * that are stored further in the file */
+    if (job && job->error == PUP_ERROR_CANCELED)
+      continue;
 
-  for (i = 0; (uint) i < header.file_count; i++)
     print_file_info (&files[i], &hashes[i]);
 
-  fclose (fd);
-  free (files);
-  free (hashes);
+    if (filenames[i][0] == '\0') {
+      printf ("*** Unknown entry id, file skipped ****\n\n");
+      continue;
+    }
+
+    if (job == NULL) {
+      printf ("Linking file %s to %s\n", filenames[i], objects[i]);
+    } else if (store && job->path == NULL) {
+      printf ("Storing the files of %s\n", filenames[i]);
+    } else {
+      printf ("Writing file %s\n", filenames[i]);
+    }
+
+    if (job && job->error == PUP_ERROR_FILE_HASH) {
+      print_wrong_hash (job, &hashes[i]);
+      goto error;
+    } else if (job && job->error != PUP_OK) {
+      print_error (filenames[i], job->error, job->error_errno);
+      goto error;
+    }
+
+    if (store && job && job->path == NULL) {
+      snprintf (path, sizeof(path), "%s.d", filenames[i]);
+      pup_entry_data (pup, i, &data);
+      if (!store_tar_members (store, data, files[i].data_length, path,
+              &stored, &linked))
+        goto error;
+      printf ("%u new objects, %u already stored\n", stored, linked);
+      continue;
+    }
+
+    if (store && job && !store_add_object (job->path, objects[i])) {
+      perror ("Couldn't add the object to the store");
+      goto error;
+    }
+    if (store && link (objects[i], filenames[i]) != 0) {
+      perror ("Couldn't link the object");
+      goto error;
+    }
+  }
+
+  for (i = 0; store && i < count; i++)
+    free ((char *) extract_jobs[i].path);
+  free (extract_jobs);
+  free (entry_jobs);
+  free (filenames);
+  free (objects);
+  pup_close (pup);
+
   return;
 
  error:
-  fclose (fd);
+  for (i = 0; store && extract_jobs && i < count; i++) {
+    if (extract_jobs[i].path)
+      unlink (extract_jobs[i].path);
+    free ((char *) extract_jobs[i].path);
+  }
+  free (extract_jobs);
+  free (entry_jobs);
+  free (filenames);
+  free (objects);
+  pup_close (pup);
+
   exit (-2);
 }
 
-
-static void extract (const char *file, const char *dest)
+/* Streams a single entry to stdout. Only errors are printed, on stderr, so
+ * the output can be piped straight into another tool. */
+static void cat (const char *file, uint64_t entry_id)
 {
-  FILE *fd = NULL;
-  FILE *out = NULL;
-  int read;
-  int written;
-  int i;
-  PUPHeader header;
-  PUPFooter footer;
-  PUPFileEntry *files = NULL;
-  PUPHashEntry *hashes = NULL;
-  char filename[PATH_MAX+1];
-  char buffer[1024];
-  HMAC_CTX context;
-  uint8_t hash[SHA1_MAC_LEN];
-  struct stat stat_buf;
+  PUPFile *pup = NULL;
+  uint8_t hash[PUP_HASH_LEN];
+  int index;
+  int ret;
 
-  if (stat (dest, &stat_buf) == 0) {
-    fprintf (stderr, "Destination directory must not exist\n");
+  pup = open_pup (file);
+  if (pup == NULL)
     goto error;
-  }
 
-  fd = fopen (file, "rb");
-
-  if (fd == NULL) {
-    perror ("Error opening input file");
+  index = pup_find_entry (pup, entry_id);
+  if (index < 0) {
+    fprintf (stderr, "Entry 0x%X not found in PUP file\n", (uint32_t) entry_id);
     goto error;
   }
 
-  if (read_header (fd, &header, &files, &hashes, &footer) == 0)
+  ret = pup_entry_send (pup, index, STDOUT_FILENO, hash);
+  if (ret == PUP_ERROR_FILE_HASH) {
+    fprintf (stderr, "PUP file is corrupted, wrong file hash\n\n");
+    fprint_hash (stderr, "File hash", hash);
+    fprint_hash (stderr, "Expected hash", pup_get_hashes (pup)[index].hash);
+    goto error;
+  } else if (ret != PUP_OK) {
+    print_error ("Couldn't write the entry", ret, errno);
     goto error;
+  }
 
-  print_header_info (&header, &footer);
+  pup_close (pup);
 
-  if (mkdir (dest, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-    perror ("Couldn't create output directory");
+  return;
+
+ error:
+  pup_close (pup);
+
+  exit (-2);
+}
+
+typedef struct {
+  char *name;
+  uint64_t size;
+  uint8_t hash[SHA1_MAC_LEN];
+} MemberHash;
+
+static int compare_members (const void *a, const void *b)
+{
+  return strcmp (((const MemberHash *) a)->name, ((const MemberHash *) b)->name);
+}
+
+static void free_members (MemberHash *members, unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    free (members[i].name);
+  free (members);
+}
+
+/* SHA-1 of every file in a tar archive, sorted by name */
+static MemberHash *hash_tar_members (const uint8_t *data, uint64_t size,
+    unsigned int *count)
+{
+  MemberHash *members = NULL;
+  MemberHash *tmp;
+  TARReader reader;
+  TARMember member;
+  size_t len;
+  int ret;
+
+  *count = 0;
+  tar_reader_init (&reader, data, size);
+  while ((ret = tar_reader_next (&reader, &member)) > 0) {
+    if (member.type == '5')
+      continue;
+
+    tmp = realloc (members, (*count + 1) * sizeof(MemberHash));
+    if (tmp == NULL)
+      goto error;
+    members = tmp;
+    members[*count].name = strdup (member.name);
+    if (members[*count].name == NULL)
+      goto error;
+    members[*count].size = member.size;
+    len = member.size;
+    sha1_vector (1, &member.data, &len, members[*count].hash);
+    (*count)++;
+  }
+  if (ret < 0) {
+    fprintf (stderr, "Archive is corrupted\n");
     goto error;
   }
 
-  for (i = 0; (uint) i < header.file_count; i++) {
-    const char *file = NULL;
-    unsigned int len;
+  qsort (members, *count, sizeof(MemberHash), compare_members);
 
-    print_file_info (&files[i], &hashes[i]);
+  return members;
 
-    file = id_to_filename (files[i].entry_id);
-    if (file == NULL) {
-      printf ("*** Unknown entry id, file skipped ****\n\n");
+ error:
+  free_members (members, *count);
+  *count = 0;
+
+  return NULL;
+}
+
+/* Member-level differences between two versions of a tar entry */
+static void diff_tar_members (const PUPFile *pup_a, unsigned int index_a,
+    const PUPFile *pup_b, unsigned int index_b)
+{
+  const uint8_t *data_a, *data_b;
+  MemberHash *a = NULL, *b = NULL;
+  unsigned int count_a = 0, count_b = 0;
+  unsigned int i = 0, j = 0;
+  int cmp;
+
+  if (pup_entry_data (pup_a, index_a, &data_a) != PUP_OK ||
+      pup_entry_data (pup_b, index_b, &data_b) != PUP_OK) {
+    printf ("\tCan't compare the archive members of a PUP that isn't mapped\n");
+    return;
+  }
+
+  a = hash_tar_members (data_a, pup_get_files (pup_a)[index_a].data_length,
+      &count_a);
+  b = hash_tar_members (data_b, pup_get_files (pup_b)[index_b].data_length,
+      &count_b);
+  if (a == NULL || b == NULL) {
+    printf ("\tCan't read the archive members\n");
+    goto done;
+  }
+
+  while (i < count_a || j < count_b) {
+    if (i == count_a)
+      cmp = 1;
+    else if (j == count_b)
+      cmp = -1;
+    else
+      cmp = strcmp (a[i].name, b[j].name);
+
+    if (cmp < 0) {
+      printf ("\tremoved  %s: %llu bytes\n", a[i].name,
+          (unsigned long long) a[i].size);
+      i++;
+    } else if (cmp > 0) {
+      printf ("\tadded    %s: %llu bytes\n", b[j].name,
+          (unsigned long long) b[j].size);
+      j++;
+    } else {
+      if (a[i].size != b[j].size)
+        printf ("\tresized  %s: %llu -> %llu bytes\n", a[i].name,
+            (unsigned long long) a[i].size, (unsigned long long) b[j].size);
+      else if (memcmp (a[i].hash, b[j].hash, SHA1_MAC_LEN) != 0)
+        printf ("\tchanged  %s\n", a[i].name);
+      i++;
+      j++;
+    }
+  }
+
+ done:
+  free_members (a, count_a);
+  free_members (b, count_b);
+}
+
+/* Compares two PUPs from their tables only, the hash table tells which
+ * entries changed without reading them. Only with members are changed tar
+ * entries read, to list the files that changed in them. Returns 1 if the
+ * PUPs differ, 0 otherwise. */
+static int diff (const char *file_a, const char *file_b, int members)
+{
+  PUPFile *pup_a = NULL;
+  PUPFile *pup_b = NULL;
+  const PUPHeader *header_a, *header_b;
+  const PUPFileEntry *files_a, *files_b;
+  const PUPHashEntry *hashes_a, *hashes_b;
+  unsigned int added = 0, removed = 0, resized = 0, changed = 0, same = 0;
+  const char *filename;
+  unsigned int i;
+  int index;
+
+  pup_a = open_pup (file_a);
+  if (pup_a == NULL)
+    goto error;
+  pup_b = open_pup (file_b);
+  if (pup_b == NULL)
+    goto error;
+
+  header_a = pup_get_header (pup_a);
+  header_b = pup_get_header (pup_b);
+  files_a = pup_get_files (pup_a);
+  files_b = pup_get_files (pup_b);
+  hashes_a = pup_get_hashes (pup_a);
+  hashes_b = pup_get_hashes (pup_b);
+
+  printf ("--- %s (image version %llu)\n+++ %s (image version %llu)\n",
+      file_a, (unsigned long long) header_a->image_version,
+      file_b, (unsigned long long) header_b->image_version);
+
+  for (i = 0; i < header_a->file_count; i++) {
+    filename = pup_id_to_filename (files_a[i].entry_id);
+    if (filename == NULL)
+      filename = "Unknown entry id";
+
+    index = pup_find_entry (pup_b, files_a[i].entry_id);
+    if (index < 0) {
+      printf ("removed  0x%X %s: %llu bytes\n", (uint32_t) files_a[i].entry_id,
+          filename, (unsigned long long) files_a[i].data_length);
+      removed++;
       continue;
     }
-    sprintf (filename, "%s/%s", dest, file);
 
-    printf ("Writing file %s\n", filename);
-    out = fopen (filename, "wb");
-    if (out == NULL) {
-      perror ("Could not open output file");
-      goto error;
+    if (files_a[i].data_length != files_b[index].data_length) {
+      printf ("resized  0x%X %s: %llu -> %llu bytes\n",
+          (uint32_t) files_a[i].entry_id, filename,
+          (unsigned long long) files_a[i].data_length,
+          (unsigned long long) files_b[index].data_length);
+      resized++;
+    } else if (memcmp (hashes_a[i].hash, hashes_b[index].hash,
+                   PUP_HASH_LEN) != 0) {
+      printf ("changed  0x%X %s\n", (uint32_t) files_a[i].entry_id, filename);
+      changed++;
+    } else {
+      same++;
+      continue;
     }
-    fseek (fd, files[i].data_offset, SEEK_SET);
-    HMACInit (&context, hmac_pup_key, sizeof(hmac_pup_key));
 
-    do {
-      len = files[i].data_length;
-      if (len > sizeof(buffer))
-        len = sizeof(buffer);
-      read = fread (buffer, 1, len, fd);
+    if (members && is_tar_entry (files_a[i].entry_id))
+      diff_tar_members (pup_a, i, pup_b, index);
+  }
 
-      if (read < 0 || (uint) read < len) {
-        perror ("Couldn't read all the data");
-        goto error;
-      }
+  for (i = 0; i < header_b->file_count; i++) {
+    if (pup_find_entry (pup_a, files_b[i].entry_id) >= 0)
+      continue;
 
-      HMACUpdate (&context, buffer, len);
+    filename = pup_id_to_filename (files_b[i].entry_id);
+    printf ("added    0x%X %s: %llu bytes\n", (uint32_t) files_b[i].entry_id,
+        filename ? filename : "Unknown entry id",
+        (unsigned long long) files_b[i].data_length);
+    added++;
+  }
 
-      written = fwrite (buffer, 1, len, out);
-      if (written < 0 || (uint) written < len) {
-        perror ("Couldn't write all the data");
-        goto error;
-      }
-      files[i].data_length -= len;
-    } while (files[i].data_length > 0);
+  printf ("%u added, %u removed, %u resized, %u changed, %u unchanged\n",
+      added, removed, resized, changed, same);
 
-    HMACFinal (hash, &context);
-    fclose (out);
-    out = NULL;
+  pup_close (pup_a);
+  pup_close (pup_b);
+
+  return added + removed + resized + changed > 0;
+
+ error:
+  pup_close (pup_a);
+  pup_close (pup_b);
+
+  exit (-2);
+}
+
+static void print_throughput (const char *message, uint64_t bytes,
+    double elapsed)
+{
+  printf ("%s: %llu bytes in %.3f s (%.1f MB/s)\n", message,
+      (unsigned long long) bytes, elapsed,
+      elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0);
+}
+
+static void verify (const char *file, unsigned int jobs)
+{
+  PUPFile *pup = NULL;
+  const PUPHeader *header;
+  const PUPFileEntry *files;
+  const PUPHashEntry *hashes;
+  PUPEntryJob *verify_jobs = NULL;
+  unsigned int i;
+  uint64_t total = 0;
+  unsigned int failed = 0;
+  struct timespec start, end;
+
+  pup = open_pup (file);
+  if (pup == NULL)
+    goto error;
 
-    if (memcmp (hash, hashes[i].hash, SHA1_MAC_LEN) != 0) {
-      fprintf (stderr, "PUP file is corrupted, wrong file hash\n\n");
-      print_hash ("File hash", hash);
-      print_hash ("Expected hash", hashes[i].hash);
+  header = pup_get_header (pup);
+  files = pup_get_files (pup);
+  hashes = pup_get_hashes (pup);
+
+  print_header_info (header, pup_get_footer (pup));
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  verify_jobs = calloc (header->file_count, sizeof(PUPEntryJob));
+  if (verify_jobs == NULL) {
+    perror ("Couldn't allocate verification jobs");
+    goto error;
+  }
+  for (i = 0; i < header->file_count; i++)
+    verify_jobs[i].index = i;
+
+  pup_run_jobs (pup, verify_jobs, header->file_count, jobs, 0);
+
+  for (i = 0; i < header->file_count; i++) {
+    PUPEntryJob *job = &verify_jobs[i];
+
+    print_file_info (&files[i], &hashes[i]);
+
+    if (job->error == PUP_ERROR_FILE_HASH) {
+      print_wrong_hash (job, &hashes[i]);
+      failed++;
+      continue;
+    } else if (job->error != PUP_OK) {
+      print_error ("Couldn't verify the entry", job->error, job->error_errno);
       goto error;
     }
 
+    print_throughput ("Verified", files[i].data_length, job->elapsed);
+    total += files[i].data_length;
   }
 
-  if (out)
-    fclose (out);
-  fclose (fd);
-  free (files);
-  free (hashes);
+  if (failed) {
+    fprintf (stderr, "%u of %llu entries failed verification\n", failed,
+        (unsigned long long) header->file_count);
+    goto error;
+  }
+
+  if (sha1_multi_lanes () > 1)
+    printf ("SHA-1 implementation: %s, %d lanes multi-buffer\n",
+        SHA1Implementation (), sha1_multi_lanes ());
+  else
+    printf ("SHA-1 implementation: %s\n", SHA1Implementation ());
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  print_throughput ("PUP file verified", total, (end.tv_sec - start.tv_sec) +
+      (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  free (verify_jobs);
+  pup_close (pup);
 
   return;
 
  error:
-  if (fd)
-    fclose (fd);
-  if (out)
-    fclose (out);
-  if (files)
-    free (files);
-  if (hashes)
-    free (hashes);
+  free (verify_jobs);
+  pup_close (pup);
 
   exit (-2);
 }
 
-static void create (const char *directory, const char *dest, long build)
+/* With a cache file, the hashes of inputs that haven't changed since the
+ * last run are reused, rehash ignores what's in the cache and replaces it. */
+static void create (const char *directory, const char *dest, long build,
+    unsigned int jobs, const char *cache_file, int rehash)
 {
-  FILE *fd = NULL;
-  FILE *out = NULL;
-  int read;
-  int written;
-  unsigned int i;
-  PUPHeader orig_header;
-  PUPHeader header;
-  PUPFooter footer;
-  PUPFileEntry *files = NULL;
-  PUPHashEntry *hashes = NULL;
+  PUPWriter *writer = NULL;
+  PUPHashCache *cache = NULL;
+  const PUPEntryID *entry = pup_entries;
   char filename[PATH_MAX+1];
-  char buffer[1024];
-  HMAC_CTX context;
   struct stat stat_buf;
-  const PUPEntryID *entry = entries;
+  unsigned int i;
+  int ret;
 
   if (stat (dest, &stat_buf) == 0) {
     fprintf (stderr, "Destination file must not exist\n");
     goto error;
   }
 
-  out = fopen (dest, "wb");
-  if (out == NULL) {
-    perror ("Could not open output file");
+  writer = pup_writer_new (build);
+  if (writer == NULL) {
+    perror ("Couldn't create the PUP writer");
     goto error;
   }
 
-  memset (&header, 0, sizeof(PUPHeader));
-  memset (&footer, 0, sizeof(PUPHeader));
+  pup_writer_set_threads (writer, jobs);
+
+  if (cache_file) {
+    ret = pup_hash_cache_load (cache_file, &cache);
+    if (ret != PUP_OK) {
+      print_error (cache_file, ret, errno);
+      goto error;
+    }
+    if (rehash)
+      pup_hash_cache_clear (cache);
+    pup_writer_set_hash_cache (writer, cache);
+  }
 
-  header.magic = PUP_MAGIC;
-  header.package_version = 1;
-  header.image_version = build;
-  header.header_length = sizeof(PUPHeader) + sizeof(PUPFooter);
+  /* An archive on stdin, its members go straight into the PUP */
+  if (strcmp (directory, "-") == 0) {
+    ret = pup_writer_write_archive (writer, STDIN_FILENO, dest);
+    if (ret != PUP_OK) {
+      print_error ("Error writing output file", ret, errno);
+      goto error;
+    }
+    goto done;
+  }
 
   while (entry->id) {
-    HMAC_CTX context;
-    PUPFileEntry *file = NULL;
-    PUPHashEntry *hash = NULL;
+    snprintf (filename, sizeof(filename), "%s/%s", directory, entry->filename);
 
-    sprintf (filename, "%s/%s", directory, entry->filename);
+    ret = pup_writer_add_file (writer, entry->id, filename);
+    if (ret == PUP_OK) {
+      printf ("Found file %s\n", filename);
+    } else if (ret != PUP_ERROR_OPEN) {
+      print_error (filename, ret, errno);
+      goto error;
+    }
+    entry++;
+  }
 
-    fd = fopen (filename, "rb");
-    if (fd == NULL) {
-      entry++;
-      continue;
+  ret = pup_writer_write (writer, dest);
+  if (ret != PUP_OK) {
+    print_error ("Error writing output file", ret, errno);
+    goto error;
+  }
+
+  /* The PUP is fine either way, the next run will just hash again */
+  if (cache) {
+    ret = pup_hash_cache_save (cache);
+    if (ret != PUP_OK)
+      print_error ("Couldn't save the hash cache", ret, errno);
+  }
+
+ done:
+  print_header_info (pup_writer_get_header (writer),
+      pup_writer_get_footer (writer));
+
+  for (i = 0; i < pup_writer_get_header (writer)->file_count; i++)
+    print_file_info (&pup_writer_get_files (writer)[i],
+        &pup_writer_get_hashes (writer)[i]);
+
+  pup_writer_free (writer);
+  pup_hash_cache_free (cache);
+
+  return;
+
+ error:
+  pup_writer_free (writer);
+  pup_hash_cache_free (cache);
+
+  exit (-2);
+}
+
+
+/* Catalog of all the PUP files found under a directory, as JSON Lines (one
+ * object per PUP and per line) or CSV (one row per entry). Every record
+ * starts with the absolute path, size, mtime and whether the entries were
+ * verified, which is what is used to tell whether a PUP already in the
+ * catalog needs to be scanned again. */
+typedef enum {
+  CATALOG_JSONL,
+  CATALOG_CSV
+} CatalogFormat;
+
+#define CATALOG_CSV_HEADER "path,size,mtime,mtime_nsec,verified,error," \
+  "package_version,image_version,entry_id,entry_name,data_offset," \
+  "data_length,hash,hash_ok\n"
+
+typedef struct {
+  char *path;
+  struct stat stat_buf;
+  char *record;
+  size_t record_len;
+  int reused;
+  int failed;
+} CatalogJob;
+
+typedef struct {
+  CatalogJob *jobs;
+  unsigned int count;
+  CatalogFormat format;
+  int verify;
+} Catalog;
+
+/* Records of an existing catalog, by path */
+typedef struct {
+  char *path;
+  uint64_t size;
+  int64_t mtime;
+  int64_t mtime_nsec;
+  int verified;
+  int failed;
+  char *record;
+  size_t record_len;
+} CatalogRecord;
+
+static char **catalog_paths = NULL;
+static unsigned int catalog_path_count = 0;
+
+static int is_pup_filename (const char *path)
+{
+  size_t len = strlen (path);
+
+  return len > 4 && strcasecmp (path + len - 4, ".pup") == 0;
+}
+
+static int catalog_walk (const char *path, const struct stat *stat_buf,
+    int type, struct FTW *ftw)
+{
+  char **paths;
+
+  if (type != FTW_F || !S_ISREG (stat_buf->st_mode) || !is_pup_filename (path))
+    return 0;
+
+  paths = realloc (catalog_paths, (catalog_path_count + 1) * sizeof(char *));
+  if (paths == NULL)
+    return -1;
+  catalog_paths = paths;
+  catalog_paths[catalog_path_count] = strdup (path);
+  if (catalog_paths[catalog_path_count] == NULL)
+    return -1;
+  catalog_path_count++;
+
+  return 0;
+}
+
+static int compare_paths (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+static void json_string (FILE *out, const char *str)
+{
+  fputc ('"', out);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf (out, "\\%c", *str);
+    else if ((unsigned char) *str < 0x20)
+      fprintf (out, "\\u%04x", (unsigned char) *str);
+    else
+      fputc (*str, out);
+  }
+  fputc ('"', out);
+}
+
+static void csv_string (FILE *out, const char *str)
+{
+  if (strpbrk (str, ",\"\r\n") == NULL) {
+    fputs (str, out);
+    return;
+  }
+
+  fputc ('"', out);
+  for (; *str; str++) {
+    if (*str == '"')
+      fputc ('"', out);
+    fputc (*str, out);
+  }
+  fputc ('"', out);
+}
+
+static void print_hex (FILE *out, const uint8_t *hash)
+{
+  int i;
+
+  for (i = 0; i < PUP_HASH_LEN; i++)
+    fprintf (out, "%.2X", hash[i]);
+}
+
+/* Reads the path at the start of a catalog line, returns a pointer to what
+ * follows it or NULL if the line is malformed. */
+static const char *parse_record_path (const char *line, CatalogFormat format,
+    char *path, size_t size)
+{
+  size_t len = 0;
+
+  if (format == CATALOG_JSONL) {
+    if (strncmp (line, "{\"path\":\"", 9) != 0)
+      return NULL;
+    for (line += 9; *line != '"'; line++) {
+      unsigned int c = (unsigned char) *line;
+
+      if (c == '\0')
+        return NULL;
+      if (c == '\\') {
+        line++;
+        if (*line == 'u') {
+          if (sscanf (line + 1, "%4x", &c) != 1)
+            return NULL;
+          line += 4;
+        } else if (*line == '\0') {
+          return NULL;
+        } else {
+          c = (unsigned char) *line;
+        }
+      }
+      if (len + 1 >= size)
+        return NULL;
+      path[len++] = c;
     }
+    path[len] = '\0';
+    return line + 1;
+  }
 
-    printf ("Found file %s\n", filename);
-    header.file_count++;
-    header.header_length += sizeof(PUPFileEntry) + sizeof(PUPHashEntry);
+  if (*line == '"') {
+    for (line++; ; line++) {
+      if (*line == '\0')
+        return NULL;
+      if (*line == '"') {
+        if (line[1] != '"')
+          break;
+        line++;
+      }
+      if (len + 1 >= size)
+        return NULL;
+      path[len++] = *line;
+    }
+    line++;
+  } else {
+    for (; *line != ',' && *line != '\0'; line++) {
+      if (len + 1 >= size)
+        return NULL;
+      path[len++] = *line;
+    }
+  }
+  path[len] = '\0';
 
-    files = realloc (files, sizeof(PUPFileEntry) * header.file_count);
-    hashes = realloc (hashes, sizeof(PUPHashEntry) * header.file_count);
+  return line;
+}
 
-    file = &files[header.file_count - 1];
-    memset (file, 0, sizeof(PUPFileEntry));
-    hash = &hashes[header.file_count - 1];
-    memset (hash, 0, sizeof(PUPHashEntry));
+static int parse_record (const char *line, CatalogFormat format,
+    CatalogRecord *record)
+{
+  char path[PATH_MAX + 1];
+  unsigned long long size;
+  long long mtime, mtime_nsec;
+  char verified[6];
+  int end = 0;
+  int parsed;
+
+  line = parse_record_path (line, format, path, sizeof(path));
+  if (line == NULL)
+    return 0;
+
+  if (format == CATALOG_JSONL)
+    parsed = sscanf (line, ",\"size\":%llu,\"mtime\":%lld,\"mtime_nsec\":%lld,"
+        "\"verified\":%5[a-z]%n", &size, &mtime, &mtime_nsec, verified, &end);
+  else
+    parsed = sscanf (line, ",%llu,%lld,%lld,%5[a-z]%n",
+        &size, &mtime, &mtime_nsec, verified, &end);
+  if (parsed != 4 || end == 0)
+    return 0;
+
+  /* Then comes the error, which is empty or null when there is none */
+  line += end;
+  if (format == CATALOG_JSONL)
+    record->failed = strncmp (line, ",\"error\":null", 13) != 0;
+  else
+    record->failed = strncmp (line, ",,", 2) != 0;
+
+  record->path = strdup (path);
+  if (record->path == NULL)
+    return 0;
+  record->size = size;
+  record->mtime = mtime;
+  record->mtime_nsec = mtime_nsec;
+  record->verified = strcmp (verified, "true") == 0;
 
-    hash->entry_id = header.file_count - 1;
-    file->entry_id = entry->id;
-    entry++;
+  return 1;
+}
+
+/* Loads an existing catalog so unchanged PUPs don't have to be scanned
+ * again. A catalog that doesn't exist or can't be parsed is just empty. */
+static CatalogRecord *load_catalog (const char *file, CatalogFormat format,
+    unsigned int *count)
+{
+  CatalogRecord *records = NULL;
+  CatalogRecord *tmp;
+  CatalogRecord record;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  FILE *fd;
+
+  *count = 0;
+
+  fd = fopen (file, "r");
+  if (fd == NULL)
+    return NULL;
+
+  while ((len = getline (&line, &line_size, fd)) > 0) {
+    if (line[len - 1] != '\n')
+      break;
+    if (format == CATALOG_CSV && strcmp (line, CATALOG_CSV_HEADER) == 0)
+      continue;
+    if (!parse_record (line, format, &record))
+      continue;
 
-    HMACInit (&context, hmac_pup_key, sizeof(hmac_pup_key));
-    do {
-      read = fread (buffer, 1, sizeof(buffer), fd);
-      if (read < 0)
+    /* A CSV record is made of all the consecutive rows of a PUP */
+    if (*count > 0 && strcmp (records[*count - 1].path, record.path) == 0) {
+      CatalogRecord *last = &records[*count - 1];
+      char *joined = realloc (last->record, last->record_len + len);
+
+      free (record.path);
+      if (joined == NULL)
         break;
+      memcpy (joined + last->record_len, line, len);
+      last->record = joined;
+      last->record_len += len;
+      continue;
+    }
 
-      HMACUpdate (&context, buffer, read);
+    tmp = realloc (records, (*count + 1) * sizeof(CatalogRecord));
+    record.record = malloc (len);
+    if (tmp == NULL || record.record == NULL) {
+      free (tmp ? NULL : record.record);
+      free (record.path);
+      if (tmp)
+        records = tmp;
+      break;
+    }
+    records = tmp;
+    memcpy (record.record, line, len);
+    record.record_len = len;
+    records[(*count)++] = record;
+  }
 
-      file->data_length += read;
-    } while (!feof (fd));
+  free (line);
+  fclose (fd);
 
-    HMACFinal (hash->hash, &context);
+  return records;
+}
+
+static void free_catalog (CatalogRecord *records, unsigned int count)
+{
+  unsigned int i;
 
-    header.data_length += file->data_length;
+  for (i = 0; i < count; i++) {
+    free (records[i].path);
+    free (records[i].record);
   }
-  for (i = 0; i < header.file_count; i++) {
-    if (i == 0)
-      files[i].data_offset = header.header_length;
-    else
-      files[i].data_offset = files[i-1].data_offset + files[i-1].data_length;
+  free (records);
+}
+
+/* Writes the catalog record of a single PUP. Runs in a worker thread. */
+static void catalog_pup (void *data, unsigned int index)
+{
+  Catalog *catalog = data;
+  CatalogJob *job = &catalog->jobs[index];
+  PUPFile *pup = NULL;
+  PUPEntryJob *verify_jobs = NULL;
+  const PUPHeader *header = NULL;
+  const PUPFileEntry *files = NULL;
+  const PUPHashEntry *hashes = NULL;
+  const char *error = NULL;
+  const char *name;
+  int verified = catalog->verify;
+  unsigned int count = 0;
+  unsigned int i;
+  FILE *out;
+  int ret;
+
+  if (job->reused)
+    return;
+
+  out = open_memstream (&job->record, &job->record_len);
+  if (out == NULL) {
+    job->failed = 1;
+    return;
   }
 
-  orig_header.magic = htonll (header.magic);
-  orig_header.package_version = htonll (header.package_version);
-  orig_header.image_version = htonll (header.image_version);
-  orig_header.file_count = htonll (header.file_count);
-  orig_header.header_length = htonll (header.header_length);
-  orig_header.data_length = htonll (header.data_length);
+  ret = pup_open (job->path, &pup);
+  if (ret != PUP_OK)
+    error = pup_strerror (ret);
+  if (pup) {
+    header = pup_get_header (pup);
+    files = pup_get_files (pup);
+    hashes = pup_get_hashes (pup);
+    count = header->file_count;
+  }
 
-  for (i = 0; i < header.file_count; i++) {
-    files[i].entry_id = htonll (files[i].entry_id);
-    files[i].data_offset = htonll (files[i].data_offset);
-    files[i].data_length = htonll (files[i].data_length);
-    hashes[i].entry_id = htonll (hashes[i].entry_id);
+  /* There's no point in checking entries against a corrupted table */
+  if (ret != PUP_OK)
+    verified = 0;
+  if (verified) {
+    verify_jobs = calloc (count + 1, sizeof(PUPEntryJob));
+    if (verify_jobs == NULL) {
+      error = pup_strerror (PUP_ERROR_NO_MEMORY);
+      verified = 0;
+    }
+  }
+  if (verified) {
+    for (i = 0; i < count; i++)
+      verify_jobs[i].index = i;
+    ret = pup_run_jobs (pup, verify_jobs, count, 1, 0);
+    if (ret != PUP_OK)
+      error = pup_strerror (ret);
+  }
+  if (error)
+    job->failed = 1;
+
+  if (catalog->format == CATALOG_JSONL) {
+    fprintf (out, "{\"path\":");
+    json_string (out, job->path);
+    fprintf (out, ",\"size\":%llu,\"mtime\":%lld,\"mtime_nsec\":%lld,"
+        "\"verified\":%s,\"error\":",
+        (unsigned long long) job->stat_buf.st_size,
+        (long long) job->stat_buf.st_mtim.tv_sec,
+        (long long) job->stat_buf.st_mtim.tv_nsec,
+        verified ? "true" : "false");
+    if (error)
+      json_string (out, error);
+    else
+      fprintf (out, "null");
+
+    if (pup) {
+      fprintf (out, ",\"package_version\":%llu,\"image_version\":%llu,"
+          "\"header_hash\":\"",
+          (unsigned long long) header->package_version,
+          (unsigned long long) header->image_version);
+      print_hex (out, pup_get_footer (pup)->hash);
+      fprintf (out, "\",\"entries\":[");
+      for (i = 0; i < count; i++) {
+        name = pup_id_to_filename (files[i].entry_id);
+        fprintf (out, "%s{\"id\":%llu,\"name\":", i ? "," : "",
+            (unsigned long long) files[i].entry_id);
+        if (name)
+          json_string (out, name);
+        else
+          fprintf (out, "null");
+        fprintf (out, ",\"offset\":%llu,\"length\":%llu,\"hash\":\"",
+            (unsigned long long) files[i].data_offset,
+            (unsigned long long) files[i].data_length);
+        print_hex (out, hashes[i].hash);
+        fprintf (out, "\"");
+        if (verified)
+          fprintf (out, ",\"hash_ok\":%s",
+              verify_jobs[i].error == PUP_OK ? "true" : "false");
+        fprintf (out, "}");
+      }
+      fprintf (out, "]");
+    }
+    fprintf (out, "}\n");
+  } else {
+    /* A PUP without entries still gets a row */
+    for (i = 0; i < count || (i == 0 && count == 0); i++) {
+      csv_string (out, job->path);
+      fprintf (out, ",%llu,%lld,%lld,%s,",
+          (unsigned long long) job->stat_buf.st_size,
+          (long long) job->stat_buf.st_mtim.tv_sec,
+          (long long) job->stat_buf.st_mtim.tv_nsec,
+          verified ? "true" : "false");
+      if (error)
+        csv_string (out, error);
+      if (pup == NULL) {
+        fprintf (out, ",,,,,,,,\n");
+        continue;
+      }
+      fprintf (out, ",%llu,%llu,",
+          (unsigned long long) header->package_version,
+          (unsigned long long) header->image_version);
+      if (count == 0) {
+        fprintf (out, ",,,,,\n");
+        continue;
+      }
+      name = pup_id_to_filename (files[i].entry_id);
+      fprintf (out, "0x%llX,%s,%llu,%llu,",
+          (unsigned long long) files[i].entry_id, name ? name : "",
+          (unsigned long long) files[i].data_offset,
+          (unsigned long long) files[i].data_length);
+      print_hex (out, hashes[i].hash);
+      fprintf (out, ",%s\n", !verified ? "" :
+          verify_jobs[i].error == PUP_OK ? "1" : "0");
+    }
   }
 
+  if (fclose (out) != 0)
+    job->failed = 1;
+  free (verify_jobs);
+  pup_close (pup);
+}
 
-  HMACInit (&context, hmac_pup_key, sizeof(hmac_pup_key));
-  HMACUpdate (&context, &orig_header, sizeof(PUPHeader));
-  HMACUpdate (&context, files, header.file_count * sizeof(PUPFileEntry));
-  HMACUpdate (&context, hashes, header.file_count * sizeof(PUPHashEntry));
-  HMACFinal (footer.hash, &context);
+/* The catalog is rebuilt in a temporary file and renamed over the old one,
+ * with the records of PUPs that haven't changed carried over as they are.
+ * PUPs that are gone are dropped. */
+static void catalog (const char *directory, const char *file,
+    CatalogFormat format, int verify, unsigned int jobs)
+{
+  Catalog data;
+  CatalogRecord *records = NULL;
+  unsigned int record_count = 0;
+  unsigned int reused = 0;
+  unsigned int failed = 0;
+  char tmp_file[PATH_MAX + 1];
+  char root[PATH_MAX + 1];
+  FILE *out = NULL;
+  unsigned int i, j;
 
-  print_header_info (&header, &footer);
+  memset (&data, 0, sizeof(data));
+  data.format = format;
+  data.verify = verify;
 
-  written = fwrite (&orig_header, sizeof(PUPHeader), 1, out);
-  if (written < 0 || written < 1) {
-    perror ("Error writing header");
+  if (snprintf (tmp_file, sizeof(tmp_file), "%s.tmp", file) >=
+      (int) sizeof(tmp_file)) {
+    fprintf (stderr, "Catalog file name is too long\n");
     goto error;
   }
 
-  written = fwrite (files, sizeof(PUPFileEntry), header.file_count, out);
-  if (written < 0 || (unsigned int) written < header.file_count) {
-    perror ("Error writing files header");
+  /* Records are kept by absolute path, so the same tree is recognized
+   * however it's named on the command line. FTW_PHYS doesn't follow links
+   * under it, so the paths of the walk stay canonical. */
+  if (realpath (directory, root) == NULL) {
+    perror ("Couldn't find the directory");
     goto error;
   }
-
-  written = fwrite (hashes, sizeof(PUPHashEntry), header.file_count, out);
-  if (written < 0 || (unsigned int) written < header.file_count) {
-    perror ("Error writing hashes header");
+  if (nftw (root, catalog_walk, 64, FTW_PHYS) != 0) {
+    perror ("Couldn't walk the directory");
     goto error;
   }
+  qsort (catalog_paths, catalog_path_count, sizeof(char *), compare_paths);
+
+  records = load_catalog (file, format, &record_count);
 
-  written = fwrite (&footer, sizeof(PUPFooter), 1, out);
-  if (written < 0 || written < 1) {
-    perror ("Error writing footer");
+  data.count = catalog_path_count;
+  data.jobs = calloc (catalog_path_count + 1, sizeof(CatalogJob));
+  if (data.jobs == NULL) {
+    perror ("Couldn't allocate catalog jobs");
     goto error;
   }
 
-  for (i = 0; i < header.file_count; i++) {
-    files[i].entry_id = ntohll (files[i].entry_id);
-    files[i].data_offset = ntohll (files[i].data_offset);
-    files[i].data_length = ntohll (files[i].data_length);
-    hashes[i].entry_id = ntohll (hashes[i].entry_id);
+  for (i = 0; i < data.count; i++) {
+    CatalogJob *job = &data.jobs[i];
+
+    job->path = catalog_paths[i];
+    if (stat (job->path, &job->stat_buf) != 0) {
+      job->failed = 1;
+      continue;
+    }
+
+    for (j = 0; j < record_count; j++) {
+      CatalogRecord *record = &records[j];
+
+      if (strcmp (record->path, job->path) != 0 ||
+          record->size != (uint64_t) job->stat_buf.st_size ||
+          record->mtime != job->stat_buf.st_mtim.tv_sec ||
+          record->mtime_nsec != job->stat_buf.st_mtim.tv_nsec ||
+          (verify && !record->verified))
+        continue;
+
+      job->record = record->record;
+      job->record_len = record->record_len;
+      job->failed = record->failed;
+      record->record = NULL;
+      job->reused = 1;
+      reused++;
+      break;
+    }
   }
 
+  pup_run_parallel (data.count, jobs, catalog_pup, &data);
 
-  for (i = 0; i < header.file_count; i++) {
-    const char *file = NULL;
-    unsigned int len;
+  out = fopen (tmp_file, "w");
+  if (out == NULL) {
+    perror ("Couldn't open the catalog file");
+    goto error;
+  }
 
-    print_file_info (&files[i], &hashes[i]);
+  if (format == CATALOG_CSV)
+    fprintf (out, CATALOG_CSV_HEADER);
 
-    file = id_to_filename (files[i].entry_id);
-    if (file == NULL) {
-      printf ("*** Unknown entry id, file skipped ****\n\n");
-      continue;
-    }
-    sprintf (filename, "%s/%s", directory, file);
+  for (i = 0; i < data.count; i++) {
+    CatalogJob *job = &data.jobs[i];
 
-    fd = fopen (filename, "rb");
-    if (fd == NULL) {
-      perror ("Could not open input file");
+    if (job->failed)
+      failed++;
+    if (job->record &&
+        fwrite (job->record, 1, job->record_len, out) != job->record_len) {
+      perror ("Couldn't write the catalog");
       goto error;
     }
+  }
 
-    fseek (out, files[i].data_offset, SEEK_SET);
-    do {
-      len = files[i].data_length;
-      if (len > sizeof(buffer))
-        len = sizeof(buffer);
-      read = fread (buffer, 1, len, fd);
+  if (fclose (out) != 0) {
+    out = NULL;
+    perror ("Couldn't write the catalog");
+    goto error;
+  }
+  out = NULL;
 
-      if (read < 0 || (uint) read < len) {
-        perror ("Couldn't read all the data");
-        goto error;
-      }
+  if (rename (tmp_file, file) != 0) {
+    perror ("Couldn't replace the catalog");
+    goto error;
+  }
 
-      written = fwrite (buffer, 1, len, out);
-      if (written < 0 || (uint) written < len) {
-        perror ("Couldn't write all the data");
-        goto error;
-      }
-      files[i].data_length -= len;
-    } while (files[i].data_length > 0);
+  printf ("Catalogued %u PUP files, %u unchanged, %u with errors\n",
+      data.count, reused, failed);
 
-    fclose (fd);
-    fd = NULL;
+  for (i = 0; i < data.count; i++) {
+    free (data.jobs[i].record);
+    free (catalog_paths[i]);
   }
+  free (data.jobs);
+  free (catalog_paths);
+  free_catalog (records, record_count);
 
-  if (fd)
-    fclose (fd);
-  fclose (out);
-  free (files);
-  free (hashes);
+  /* Like pup v, so batch jobs can tell */
+  if (failed > 0)
+    exit (-2);
 
   return;
 
  error:
-  if (fd)
-    fclose (fd);
-  if (out)
+  if (out) {
     fclose (out);
-  if (files)
-    free (files);
-  if (hashes)
-    free (hashes);
-
+    unlink (tmp_file);
+  }
   exit (-2);
 }
 
+/* Entries can be given by filename or by id, in decimal or hexadecimal.
+ * Returns 0 if it's neither. */
+static uint64_t parse_entry_id (const char *entry)
+{
+  char *end = NULL;
+  uint64_t entry_id;
+
+  entry_id = pup_filename_to_id (entry);
+  if (entry_id != 0)
+    return entry_id;
+
+  errno = 0;
+  entry_id = strtoull (entry, &end, 0);
+  if (errno != 0 || end == entry || *end != '\0')
+    return 0;
+
+  return entry_id;
+}
 
 int main (int argc, char *argv[])
 {
+  unsigned int jobs = 1;
+  uint64_t *selected = NULL;
+  unsigned int selected_count = 0;
+  uint64_t entry_id;
+  const char *cache_file = NULL;
+  int rehash = 0;
+  CatalogFormat format = CATALOG_JSONL;
+  int verify_entries = 0;
+  int members = 0;
+  const char *store = NULL;
+  int opt;
 
   fprintf (stderr, "PUP Creator/Extractor %s\nBy KaKaRoTo\n\n", VERSION);
 
   if (argc < 2)
     usage (argv[0]);
 
+  if (strcmp (argv[1], "cat") == 0) {
+    if (argc != 4)
+      usage (argv[0]);
+    entry_id = parse_entry_id (argv[3]);
+    if (entry_id == 0) {
+      fprintf (stderr, "Unknown entry %s\n", argv[3]);
+      exit (-1);
+    }
+    cat (argv[2], entry_id);
+    return 0;
+  }
+
+  if (strcmp (argv[1], "catalog") == 0) {
+    optind = 2;
+    while ((opt = getopt (argc, argv, "j:f:V")) != -1) {
+      if (opt == 'V') {
+        verify_entries = 1;
+      } else if (opt == 'f' && strcmp (optarg, "jsonl") == 0) {
+        format = CATALOG_JSONL;
+      } else if (opt == 'f' && strcmp (optarg, "csv") == 0) {
+        format = CATALOG_CSV;
+      } else if (opt == 'j' && atoi (optarg) >= 1) {
+        jobs = atoi (optarg);
+      } else {
+        usage (argv[0]);
+      }
+    }
+    if (argc - optind != 2)
+      usage (argv[0]);
+    catalog (argv[optind], argv[optind + 1], format, verify_entries, jobs);
+    return 0;
+  }
+
   if (argv[1][1] != '\0')
     usage (argv[0]);
 
@@ -620,14 +1733,84 @@ int main (int argc, char *argv[])
       break;
     case 'e':
     case 'x':
-      if (argc != 4)
+      selected = calloc (argc, sizeof(uint64_t));
+      if (selected == NULL) {
+        perror ("Couldn't allocate memory");
+        exit (-2);
+      }
+      optind = 2;
+      while ((opt = getopt (argc, argv, "j:e:s:m")) != -1) {
+        if (opt == 's') {
+          store = optarg;
+          continue;
+        } else if (opt == 'm') {
+          members = 1;
+          continue;
+        } else if (opt == 'e') {
+          selected[selected_count] = parse_entry_id (optarg);
+          if (selected[selected_count] == 0) {
+            fprintf (stderr, "Unknown entry %s\n", optarg);
+            exit (-1);
+          }
+          selected_count++;
+          continue;
+        }
+        if (opt != 'j' || atoi (optarg) < 1)
+          usage (argv[0]);
+        jobs = atoi (optarg);
+      }
+      if (argc - optind != 2 || (members && store == NULL))
         usage (argv[0]);
-      extract (argv[2], argv[3]);
+      extract (argv[optind], argv[optind + 1], jobs, selected, selected_count,
+          store, members);
+      free (selected);
       break;
+    case 'v':
+      optind = 2;
+      while ((opt = getopt (argc, argv, "j:")) != -1) {
+        if (opt != 'j' || atoi (optarg) < 1)
+          usage (argv[0]);
+        jobs = atoi (optarg);
+      }
+      if (argc - optind != 1)
+        usage (argv[0]);
+      verify (argv[optind], jobs);
+      break;
+    case 'd':
+      optind = 2;
+      while ((opt = getopt (argc, argv, "t")) != -1) {
+        if (opt != 't')
+          usage (argv[0]);
+        members = 1;
+      }
+      if (argc - optind != 2)
+        usage (argv[0]);
+      return diff (argv[optind], argv[optind + 1], members);
     case 'c':
-      if (argc != 5)
+      optind = 2;
+      while ((opt = getopt (argc, argv, "j:C:R")) != -1) {
+        if (opt == 'C') {
+          cache_file = optarg;
+          continue;
+        } else if (opt == 'R') {
+          rehash = 1;
+          continue;
+        }
+        if (opt != 'j' || atoi (optarg) < 1)
+          usage (argv[0]);
+        jobs = atoi (optarg);
+      }
+      if (argc - optind != 3)
         usage (argv[0]);
-      create (argv[2], argv[3], atol (argv[4]));
+      /* Archive members are hashed as they are read, in a single pass */
+      if (strcmp (argv[optind], "-") == 0 &&
+          (jobs > 1 || cache_file || rehash)) {
+        fprintf (stderr, "-j, -C and -R can't be used with an archive "
+            "on stdin\n");
+        exit (-1);
+      }
+      create (argv[optind], argv[optind + 1], atol (argv[optind + 2]), jobs,
+          cache_file, rehash);
       break;
     default:
       usage (argv[0]);
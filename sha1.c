@@ -14,8 +14,32 @@
 
 #include "sha1.h"
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#define SHA1_ARMV8 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* Hashes `blocks` consecutive 64 byte blocks, see sha1_select() */
+typedef void (*SHA1BlocksFunc) (uint32_t state[5], const unsigned char *data,
+    size_t blocks);
+static SHA1BlocksFunc sha1_blocks;
+
+static inline uint32_t load_be32 (const unsigned char *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+      ((uint32_t) p[2] << 8) | p[3];
+}
+
 
 /* ===== start - public domain SHA1 implementation ===== */
 
@@ -101,10 +125,12 @@ A million repetitions of "a"
 
 /* blk0() and blk() perform the initial expand. */
 /* I got the idea of expanding during the round function from SSLeay */
-#define blk0(i) (block->l[i] = blk0_endiansafe (block->l[i]))
+/* The message words are loaded big endian straight from the input, so
+ * blocks are hashed in place without copying them to a workspace first. */
+#define blk0(i) (block[i] = load_be32 (&buffer[(i) * 4]))
 
-#define blk(i) (block->l[i & 15] = rol(block->l[(i + 13) & 15] ^ \
-	block->l[(i + 8) & 15] ^ block->l[(i + 2) & 15] ^ block->l[i & 15], 1))
+#define blk(i) (block[i & 15] = rol(block[(i + 13) & 15] ^ \
+	block[(i + 8) & 15] ^ block[(i + 2) & 15] ^ block[i & 15], 1))
 
 /* (R0+R1), R2, R3, R4 are the different operations used in SHA1 */
 #define R0(v,w,x,y,z,i) \
@@ -125,31 +151,10 @@ A million repetitions of "a"
 static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]);
 /* Hash a single 512-bit block. This is the core of the algorithm. */
 
-static int am_big_endian(void)
-{
-  long one= 1;
-  return !(*((char *)(&one)));
-}
-
-static uint32_t blk0_endiansafe (uint32_t l)
-{
-  if (am_big_endian ())
-    return l;
-  else
-    return (rol(l, 24) & 0xFF00FF00) | (rol(l, 8) & 0x00FF00FF);
-}
-
 static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
 {
   uint32_t a, b, c, d, e;
-  typedef union {
-    uint8_t c[64];
-    uint32_t l[16];
-  } CHAR64LONG16;
-  CHAR64LONG16* block;
-  uint8_t workspace[64];
-  block = (CHAR64LONG16 *) workspace;
-  memcpy(block, buffer, 64);
+  uint32_t block[16];
 
   /* Copy context->state[] to working vars */
   a = state[0];
@@ -186,7 +191,7 @@ static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
   state[4] += e;
   /* Wipe variables */
   a = b = c = d = e = 0;
-  memset(block, 0, 64);
+  memset(block, 0, sizeof(block));
 }
 
 
@@ -206,25 +211,38 @@ void SHA1Init(SHA1_CTX* context)
 
 /* Run your data through this. */
 
-void SHA1Update(SHA1_CTX* context, const void *_data, uint32_t len)
+void SHA1Update64(SHA1_CTX* context, const void *_data, uint64_t len)
 {
-  uint32_t i, j;
+  uint64_t i, j, count;
   const unsigned char *data = _data;
 
-  j = (context->count[0] >> 3) & 63;
-  if ((context->count[0] += len << 3) < (len << 3))
-    context->count[1]++;
-  context->count[1] += (len >> 29);
-  if ((j + len) > 63) {
-    memcpy(&context->buffer[j], data, (i = 64-j));
-    SHA1Transform(context->state, context->buffer);
-    for ( ; i + 63 < len; i += 64) {
-      SHA1Transform(context->state, &data[i]);
+  count = ((uint64_t) context->count[1] << 32) | context->count[0];
+  j = (count >> 3) & 63;
+  count += len << 3;
+  context->count[0] = (uint32_t) count;
+  context->count[1] = (uint32_t) (count >> 32);
+
+  i = 0;
+  if (j > 0) {
+    /* Complete the buffered partial block first */
+    if (j + len < 64) {
+      memcpy(&context->buffer[j], data, len);
+      return;
     }
-    j = 0;
+    memcpy(&context->buffer[j], data, (i = 64-j));
+    sha1_blocks(context->state, context->buffer, 1);
+  }
+  /* Whole blocks are hashed directly from the caller's buffer */
+  if (len - i >= 64) {
+    sha1_blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~(uint64_t) 63;
   }
-  else i = 0;
-  memcpy(&context->buffer[j], &data[i], len - i);
+  memcpy(context->buffer, &data[i], len - i);
+}
+
+void SHA1Update(SHA1_CTX* context, const void *data, uint32_t len)
+{
+  SHA1Update64(context, data, len);
 }
 
 
@@ -232,20 +250,25 @@ void SHA1Update(SHA1_CTX* context, const void *_data, uint32_t len)
 
 void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
 {
-  uint32_t i;
-  unsigned char finalcount[8];
+  uint32_t i, j;
 
+  /* The padding is built directly in the last block(s): 0x80, zeroes,
+   * then the 64 bit big endian bit count */
+  j = (context->count[0] >> 3) & 63;
+  context->buffer[j++] = 0x80;
+  if (j > 56) {
+    memset(&context->buffer[j], 0, 64 - j);
+    sha1_blocks(context->state, context->buffer, 1);
+    j = 0;
+  }
+  memset(&context->buffer[j], 0, 56 - j);
   for (i = 0; i < 8; i++) {
-    finalcount[i] = (unsigned char)
+    context->buffer[56 + i] = (unsigned char)
         ((context->count[(i >= 4 ? 0 : 1)] >>
             ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
   }
-  SHA1Update(context, (unsigned char *) "\200", 1);
-  while ((context->count[0] & 504) != 448) {
-    SHA1Update(context, (unsigned char *) "\0", 1);
-  }
-  SHA1Update(context, finalcount, 8);  /* Should cause a SHA1Transform()
-					      */
+  sha1_blocks(context->state, context->buffer, 1);
+
   for (i = 0; i < 20; i++) {
     digest[i] = (unsigned char)
         ((context->state[i >> 2] >> ((3 - (i & 3)) * 8)) &
@@ -256,16 +279,434 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
   memset(context->buffer, 0, 64);
   memset(context->state, 0, 20);
   memset(context->count, 0, 8);
-  memset(finalcount, 0, 8);
 }
 
 /* ===== end - public domain SHA1 implementation ===== */
 
 
-void HMACInit(HMAC_CTX* context, const uint8_t *key, size_t key_len)
+/* Hardware accelerated block functions. Each one hashes `blocks` consecutive
+ * 64 byte blocks into state, and is selected at runtime by sha1_select(),
+ * falling back to SHA1Transform() when the CPU doesn't support it. The
+ * compiler flags for the instruction sets are only enabled on the functions
+ * themselves so the rest of the file stays portable. */
+
+static void sha1_blocks_generic (uint32_t state[5], const unsigned char *data,
+    size_t blocks)
 {
-  unsigned char ipad[64]; /* padding - key XORd with ipad */
+  while (blocks--) {
+    SHA1Transform(state, data);
+    data += 64;
+  }
+}
+
+#ifdef SHA1_X86
+
+/* Rounds 4k to 4k+3, for k >= 4, rotating through the four message
+ * registers. The message schedule updates done in the last few groups
+ * are unused but harmless. */
+#define SHANI_ROUNDS(Ea, Eb, Mk, Mn, Mp, Mm, f) \
+	Ea = _mm_sha1nexte_epu32(Ea, Mk); \
+	Eb = abcd; \
+	Mn = _mm_sha1msg2_epu32(Mn, Mk); \
+	abcd = _mm_sha1rnds4_epu32(abcd, Ea, f); \
+	Mp = _mm_sha1msg1_epu32(Mp, Mk); \
+	Mm = _mm_xor_si128(Mm, Mk);
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani (uint32_t state[5], const unsigned char *data,
+    size_t blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+      0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  abcd = _mm_loadu_si128((const __m128i *) state);
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  while (blocks--) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* Rounds 0-3 */
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    /* Rounds 4-7 */
+    msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)),
+        mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    /* Rounds 8-11 */
+    msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)),
+        mask);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 12-15 */
+    msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)),
+        mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 16-79 */
+    SHANI_ROUNDS(e0, e1, msg0, msg1, msg3, msg2, 0);
+    SHANI_ROUNDS(e1, e0, msg1, msg2, msg0, msg3, 1);
+    SHANI_ROUNDS(e0, e1, msg2, msg3, msg1, msg0, 1);
+    SHANI_ROUNDS(e1, e0, msg3, msg0, msg2, msg1, 1);
+    SHANI_ROUNDS(e0, e1, msg0, msg1, msg3, msg2, 1);
+    SHANI_ROUNDS(e1, e0, msg1, msg2, msg0, msg3, 1);
+    SHANI_ROUNDS(e0, e1, msg2, msg3, msg1, msg0, 2);
+    SHANI_ROUNDS(e1, e0, msg3, msg0, msg2, msg1, 2);
+    SHANI_ROUNDS(e0, e1, msg0, msg1, msg3, msg2, 2);
+    SHANI_ROUNDS(e1, e0, msg1, msg2, msg0, msg3, 2);
+    SHANI_ROUNDS(e0, e1, msg2, msg3, msg1, msg0, 2);
+    SHANI_ROUNDS(e1, e0, msg3, msg0, msg2, msg1, 3);
+    SHANI_ROUNDS(e0, e1, msg0, msg1, msg3, msg2, 3);
+    SHANI_ROUNDS(e1, e0, msg1, msg2, msg0, msg3, 3);
+    SHANI_ROUNDS(e0, e1, msg2, msg3, msg1, msg0, 3);
+    SHANI_ROUNDS(e1, e0, msg3, msg0, msg2, msg1, 3);
+
+    /* Add the working vars back into state */
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+
+    data += 64;
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128((__m128i *) state, abcd);
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int sha1_has_shani (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  /* SSSE3 and SSE4.1 are needed along with the SHA extensions */
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return 0;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+
+  return (ebx & bit_SHA) != 0;
+}
+
+#endif /* SHA1_X86 */
+
+#ifdef SHA1_ARMV8
+
+#if defined(__clang__)
+#define SHA1_ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define SHA1_ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+/* Rounds 4k to 4k+3: op is one of vsha1cq/vsha1pq/vsha1mq, Ein is the e
+ * value for this group and Eout receives the one for the next. tmp already
+ * holds W + K for this group and is refilled for group k+2. */
+#define ARMV8_ROUNDS(op, Eout, Ein, tmp, Mnext, k_next, Mp, Mk, Mn, Mq) \
+	Eout = vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+	abcd = op(abcd, Ein, tmp); \
+	tmp = vaddq_u32(Mnext, k_next); \
+	Mp = vsha1su1q_u32(Mp, Mq); \
+	Mk = vsha1su0q_u32(Mk, Mn, Mq);
+
+SHA1_ARMV8_TARGET
+static void sha1_blocks_armv8 (uint32_t state[5], const unsigned char *data,
+    size_t blocks)
+{
+  const uint32x4_t k0 = vdupq_n_u32(0x5A827999);
+  const uint32x4_t k1 = vdupq_n_u32(0x6ED9EBA1);
+  const uint32x4_t k2 = vdupq_n_u32(0x8F1BBCDC);
+  const uint32x4_t k3 = vdupq_n_u32(0xCA62C1D6);
+  uint32x4_t abcd, abcd_save;
+  uint32x4_t tmp0, tmp1;
+  uint32x4_t msg0, msg1, msg2, msg3;
+  uint32_t e0, e0_save, e1;
+
+  abcd = vld1q_u32(state);
+  e0 = state[4];
+
+  while (blocks--) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+    tmp0 = vaddq_u32(msg0, k0);
+    tmp1 = vaddq_u32(msg1, k0);
+
+    /* Rounds 0-3 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k0);
+    msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+    /* Rounds 4-63 */
+    ARMV8_ROUNDS(vsha1cq_u32, e0, e1, tmp1, msg3, k0, msg0, msg1, msg2, msg3);
+    ARMV8_ROUNDS(vsha1cq_u32, e1, e0, tmp0, msg0, k0, msg1, msg2, msg3, msg0);
+    ARMV8_ROUNDS(vsha1cq_u32, e0, e1, tmp1, msg1, k1, msg2, msg3, msg0, msg1);
+    ARMV8_ROUNDS(vsha1cq_u32, e1, e0, tmp0, msg2, k1, msg3, msg0, msg1, msg2);
+    ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg3, k1, msg0, msg1, msg2, msg3);
+    ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg0, k1, msg1, msg2, msg3, msg0);
+    ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg1, k1, msg2, msg3, msg0, msg1);
+    ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg2, k2, msg3, msg0, msg1, msg2);
+    ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg3, k2, msg0, msg1, msg2, msg3);
+    ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg0, k2, msg1, msg2, msg3, msg0);
+    ARMV8_ROUNDS(vsha1mq_u32, e0, e1, tmp1, msg1, k2, msg2, msg3, msg0, msg1);
+    ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg2, k2, msg3, msg0, msg1, msg2);
+    ARMV8_ROUNDS(vsha1mq_u32, e0, e1, tmp1, msg3, k3, msg0, msg1, msg2, msg3);
+    ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg0, k3, msg1, msg2, msg3, msg0);
+    ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg1, k3, msg2, msg3, msg0, msg1);
+
+    /* Rounds 64-67 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+    tmp0 = vaddq_u32(msg2, k3);
+    msg3 = vsha1su1q_u32(msg3, msg2);
+
+    /* Rounds 68-71 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+    tmp1 = vaddq_u32(msg3, k3);
+
+    /* Rounds 72-75 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, tmp0);
+
+    /* Rounds 76-79 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, tmp1);
+
+    /* Add the working vars back into state */
+    e0 += e0_save;
+    abcd = vaddq_u32(abcd_save, abcd);
+
+    data += 64;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+
+#endif /* SHA1_ARMV8 */
+
+/* Multi-buffer hashing: independent messages are hashed in lockstep, one
+ * per 32 bit lane of a vector register. This only pays off when there is
+ * no single-stream acceleration, see sha1_multi_lanes(). */
+
+#define SHA1_MB_MAX_LANES 16
+
+/* Hashes `blocks` blocks from each data[lane] into the transposed
+ * state[word][lane] */
+typedef void (*SHA1MultiFunc) (uint32_t state[5][SHA1_MB_MAX_LANES],
+    const unsigned char *data[SHA1_MB_MAX_LANES], size_t blocks);
+
+#ifdef SHA1_X86
+
+/* The kernels below share their rounds, written in terms of the VADD,
+ * VXOR, VAND, VOR, VROL and VSET1 vector operations which each kernel
+ * defines for its own register width. */
+#define MB_F1(b,c,d) VXOR(d, VAND(b, VXOR(c, d)))
+#define MB_F2(b,c,d) VXOR(b, VXOR(c, d))
+#define MB_F3(b,c,d) VOR(VAND(b, c), VAND(d, VOR(b, c)))
+
+#define MB_BLK(i) (w[(i) & 15] = VROL(VXOR(VXOR(w[((i) + 13) & 15], \
+	w[((i) + 8) & 15]), VXOR(w[((i) + 2) & 15], w[(i) & 15])), 1))
+
+#define MB_ROUNDS(first, last, f, k) \
+	for (t = first; t <= last; t++) { \
+	  tmp = VADD(VADD(VROL(a, 5), f(b, c, d)), \
+	      VADD(VADD(e, VSET1(k)), t < 16 ? w[t] : MB_BLK(t))); \
+	  e = d; \
+	  d = c; \
+	  c = VROL(b, 30); \
+	  b = a; \
+	  a = tmp; \
+	}
+
+#define MB_BLOCK(lanes) \
+	for (t = 0; t < 16; t++) { \
+	  uint32_t words[lanes]; \
+	  for (lane = 0; lane < lanes; lane++) \
+	    words[lane] = load_be32(data[lane] + 4 * t); \
+	  w[t] = VLOADU(words); \
+	} \
+	a = sa; b = sb; c = sc; d = sd; e = se; \
+	MB_ROUNDS(0, 19, MB_F1, 0x5A827999); \
+	MB_ROUNDS(20, 39, MB_F2, 0x6ED9EBA1); \
+	MB_ROUNDS(40, 59, MB_F3, 0x8F1BBCDC); \
+	MB_ROUNDS(60, 79, MB_F2, 0xCA62C1D6); \
+	sa = VADD(sa, a); sb = VADD(sb, b); sc = VADD(sc, c); \
+	sd = VADD(sd, d); se = VADD(se, e); \
+	for (lane = 0; lane < lanes; lane++) \
+	  data[lane] += 64;
+
+#define VADD _mm256_add_epi32
+#define VXOR _mm256_xor_si256
+#define VAND _mm256_and_si256
+#define VOR _mm256_or_si256
+#define VROL(x, n) VOR(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define VSET1(x) _mm256_set1_epi32((int) (x))
+#define VLOADU(p) _mm256_loadu_si256((const __m256i *) (p))
+#define VSTOREU(p, x) _mm256_storeu_si256((__m256i *) (p), x)
+
+__attribute__((target("avx2")))
+static void sha1_multi_avx2 (uint32_t state[5][SHA1_MB_MAX_LANES],
+    const unsigned char *lane_data[SHA1_MB_MAX_LANES], size_t blocks)
+{
+  const unsigned char *data[8];
+  __m256i sa, sb, sc, sd, se, a, b, c, d, e, tmp;
+  __m256i w[16];
+  int t, lane;
+
+  memcpy(data, lane_data, sizeof(data));
+  sa = VLOADU(state[0]);
+  sb = VLOADU(state[1]);
+  sc = VLOADU(state[2]);
+  sd = VLOADU(state[3]);
+  se = VLOADU(state[4]);
+
+  while (blocks--) {
+    MB_BLOCK(8);
+  }
+
+  VSTOREU(state[0], sa);
+  VSTOREU(state[1], sb);
+  VSTOREU(state[2], sc);
+  VSTOREU(state[3], sd);
+  VSTOREU(state[4], se);
+}
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VROL
+#undef VSET1
+#undef VLOADU
+#undef VSTOREU
+
+#define VADD _mm512_add_epi32
+#define VXOR _mm512_xor_si512
+#define VAND _mm512_and_si512
+#define VOR _mm512_or_si512
+#define VROL(x, n) _mm512_rol_epi32(x, n)
+#define VSET1(x) _mm512_set1_epi32((int) (x))
+#define VLOADU(p) _mm512_loadu_si512((const void *) (p))
+#define VSTOREU(p, x) _mm512_storeu_si512((void *) (p), x)
+
+__attribute__((target("avx512f")))
+static void sha1_multi_avx512 (uint32_t state[5][SHA1_MB_MAX_LANES],
+    const unsigned char *lane_data[SHA1_MB_MAX_LANES], size_t blocks)
+{
+  const unsigned char *data[16];
+  __m512i sa, sb, sc, sd, se, a, b, c, d, e, tmp;
+  __m512i w[16];
+  int t, lane;
+
+  memcpy(data, lane_data, sizeof(data));
+  sa = VLOADU(state[0]);
+  sb = VLOADU(state[1]);
+  sc = VLOADU(state[2]);
+  sd = VLOADU(state[3]);
+  se = VLOADU(state[4]);
+
+  while (blocks--) {
+    MB_BLOCK(16);
+  }
+
+  VSTOREU(state[0], sa);
+  VSTOREU(state[1], sb);
+  VSTOREU(state[2], sc);
+  VSTOREU(state[3], sd);
+  VSTOREU(state[4], se);
+}
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VROL
+#undef VSET1
+#undef VLOADU
+#undef VSTOREU
+
+#endif /* SHA1_X86 */
+
+static SHA1MultiFunc sha1_multi_blocks = NULL;
+static int sha1_multi_lane_count = 1;
+
+static SHA1BlocksFunc sha1_blocks = sha1_blocks_generic;
+static const char *sha1_implementation = "generic";
+
+/* Picks the block functions once at startup, before any thread can hash
+ * anything. Setting PS3UTILS_SHA1=generic in the environment forces the
+ * portable single-stream implementation, which also lets the multi-buffer
+ * kernels be used by the batch functions. */
+__attribute__((constructor))
+static void sha1_select (void)
+{
+  const char *force = getenv("PS3UTILS_SHA1");
+
+#if defined(SHA1_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    sha1_multi_blocks = sha1_multi_avx512;
+    sha1_multi_lane_count = 16;
+  } else if (__builtin_cpu_supports("avx2")) {
+    sha1_multi_blocks = sha1_multi_avx2;
+    sha1_multi_lane_count = 8;
+  }
+#endif
+
+  if (force != NULL && strcmp(force, "generic") == 0)
+    return;
+
+#if defined(SHA1_X86)
+  if (sha1_has_shani()) {
+    sha1_blocks = sha1_blocks_shani;
+    sha1_implementation = "sha-ni";
+  }
+#elif defined(SHA1_ARMV8)
+  if (getauxval(AT_HWCAP) & HWCAP_SHA1) {
+    sha1_blocks = sha1_blocks_armv8;
+    sha1_implementation = "armv8";
+  }
+#endif
+}
+
+const char *SHA1Implementation(void)
+{
+  return sha1_implementation;
+}
+
+
+/* Precomputes the SHA-1 states after the ipad and opad blocks, so that
+ * each message only has to clone them instead of hashing the pads again. */
+void HMACKeyInit(HMAC_KEY *hmac_key, const uint8_t *key, size_t key_len)
+{
+  unsigned char pad[64]; /* padding - key XORd with ipad/opad */
   unsigned char tk[20];
+  SHA1_CTX ctx;
   size_t i;
 
   /* if key is longer than 64 bytes reset it to key = SHA1(key) */
@@ -276,19 +717,53 @@ void HMACInit(HMAC_CTX* context, const uint8_t *key, size_t key_len)
   }
 
   /* start out by storing key in ipad */
-  memset(ipad, 0, sizeof(ipad));
-  memcpy(ipad, key, key_len);
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, key, key_len);
 
   /* XOR key with ipad values */
   for (i = 0; i < 64; i++)
-    ipad[i] ^= 0x36;
+    pad[i] ^= 0x36;
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, pad, sizeof(pad));
+  memcpy(hmac_key->inner, ctx.state, sizeof(hmac_key->inner));
 
-  /* Store the key in our context */
-  memcpy(context->key, key, key_len);
-  context->key_len = key_len;
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, key, key_len);
 
-  SHA1Init (&context->context);
-  SHA1Update (&context->context, ipad, sizeof(ipad));
+  /* XOR key with opad values */
+  for (i = 0; i < 64; i++)
+    pad[i] ^= 0x5c;
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, pad, sizeof(pad));
+  memcpy(hmac_key->outer, ctx.state, sizeof(hmac_key->outer));
+
+  memset(pad, 0, sizeof(pad));
+  memset(&ctx, 0, sizeof(ctx));
+}
+
+/* Starts a SHA-1 context from a midstate, one block into the message */
+static void sha1_init_midstate(SHA1_CTX *context, const uint32_t state[5])
+{
+  memcpy(context->state, state, sizeof(context->state));
+  context->count[0] = 64 << 3;
+  context->count[1] = 0;
+}
+
+void HMACInitKeyed(HMAC_CTX *context, const HMAC_KEY *key)
+{
+  sha1_init_midstate(&context->context, key->inner);
+  memcpy(context->outer, key->outer, sizeof(context->outer));
+}
+
+void HMACInit(HMAC_CTX* context, const uint8_t *key, size_t key_len)
+{
+  HMAC_KEY hmac_key;
+
+  HMACKeyInit(&hmac_key, key, key_len);
+  HMACInitKeyed(context, &hmac_key);
+  memset(&hmac_key, 0, sizeof(hmac_key));
 }
 
 void HMACUpdate(HMAC_CTX *context, const void *data, uint32_t len)
@@ -296,30 +771,22 @@ void HMACUpdate(HMAC_CTX *context, const void *data, uint32_t len)
   SHA1Update (&context->context, data, len);
 }
 
-void HMACFinal(unsigned char digest[20], HMAC_CTX *context)
+void HMACUpdate64(HMAC_CTX *context, const void *data, uint64_t len)
 {
+  SHA1Update64 (&context->context, data, len);
+}
 
-  unsigned char opad[64]; /* padding - key XORd with opad */
+void HMACFinal(unsigned char digest[20], HMAC_CTX *context)
+{
   unsigned char sha1_digest[SHA1_MAC_LEN];
-  const uint8_t *_addr[2];
-  size_t _len[2];
-  size_t i;
 
   SHA1Final (sha1_digest, &context->context);
 
-  memset(opad, 0, sizeof(opad));
-  memcpy(opad, context->key, context->key_len);
-
-  /* XOR key with opad values */
-  for (i = 0; i < 64; i++)
-    opad[i] ^= 0x5c;
-
   /* perform outer SHA1 */
-  _addr[0] = opad;
-  _len[0] = 64;
-  _addr[1] = sha1_digest;
-  _len[1] = SHA1_MAC_LEN;
-  sha1_vector(2, _addr, _len, digest);
+  sha1_init_midstate(&context->context, context->outer);
+  SHA1Update (&context->context, sha1_digest, SHA1_MAC_LEN);
+  SHA1Final (digest, &context->context);
+  memset(context->outer, 0, sizeof(context->outer));
 }
 
 
@@ -478,7 +945,226 @@ void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
 
   SHA1Init(&ctx);
   for (i = 0; i < num_elem; i++)
-    SHA1Update(&ctx, addr[i], len[i]);
+    SHA1Update64(&ctx, addr[i], len[i]);
   SHA1Final(mac, &ctx);
 }
 
+
+
+/* Advances the bit count of a context by a number of bytes */
+static void sha1_count_add(SHA1_CTX *context, uint64_t bytes)
+{
+  uint64_t count = ((uint64_t) context->count[1] << 32) | context->count[0];
+
+  count += bytes << 3;
+  context->count[0] = (uint32_t) count;
+  context->count[1] = (uint32_t) (count >> 32);
+}
+
+typedef struct {
+  SHA1_CTX *context;
+  const uint8_t *data;
+  size_t len;
+} SHA1MultiJob;
+
+/* Feeds the whole blocks of every job through the multi-buffer kernel,
+ * refilling a lane with the next message as soon as its message runs out
+ * of blocks, then hashes whatever is left with SHA1Update(). The contexts
+ * must not have any partial block buffered. */
+static void sha1_multi_update(SHA1MultiJob *jobs, size_t num)
+{
+  uint32_t state[5][SHA1_MB_MAX_LANES];
+  const unsigned char *data[SHA1_MB_MAX_LANES];
+  SHA1MultiJob *lane_job[SHA1_MB_MAX_LANES];
+  const unsigned char *filler;
+  size_t next = 0;
+  size_t blocks;
+  size_t i;
+  int lanes = sha1_multi_blocks ? sha1_multi_lane_count : 0;
+  int lane, active, w;
+
+  memset(lane_job, 0, sizeof(lane_job));
+  memset(state, 0, sizeof(state));
+
+  while (lanes > 1) {
+    active = 0;
+    filler = NULL;
+    blocks = SIZE_MAX;
+    for (lane = 0; lane < lanes; lane++) {
+      while (lane_job[lane] == NULL && next < num) {
+        if (jobs[next].len >= 64)
+          lane_job[lane] = &jobs[next];
+        next++;
+      }
+      if (lane_job[lane]) {
+        active++;
+        filler = lane_job[lane]->data;
+        if (lane_job[lane]->len / 64 < blocks)
+          blocks = lane_job[lane]->len / 64;
+      }
+    }
+    if (active < 2)
+      break;
+
+    /* Idle lanes hash a copy of a live lane's data and are discarded */
+    for (lane = 0; lane < lanes; lane++) {
+      if (lane_job[lane] == NULL) {
+        data[lane] = filler;
+        continue;
+      }
+      data[lane] = lane_job[lane]->data;
+      for (w = 0; w < 5; w++)
+        state[w][lane] = lane_job[lane]->context->state[w];
+    }
+
+    sha1_multi_blocks(state, data, blocks);
+
+    for (lane = 0; lane < lanes; lane++) {
+      SHA1MultiJob *job = lane_job[lane];
+
+      if (job == NULL)
+        continue;
+      for (w = 0; w < 5; w++)
+        job->context->state[w] = state[w][lane];
+      sha1_count_add(job->context, blocks * 64);
+      job->data += blocks * 64;
+      job->len -= blocks * 64;
+      if (job->len < 64)
+        lane_job[lane] = NULL;
+    }
+  }
+
+  for (i = 0; i < num; i++)
+    SHA1Update64(jobs[i].context, jobs[i].data, jobs[i].len);
+}
+
+/**
+ * sha1_multi_lanes:
+ *
+ * Returns the number of messages sha1_multi() and hmac_sha1_multi() hash
+ * in parallel, or 1 if they would simply hash them one after the other
+ * because single-stream hashing is accelerated or no vector unit is
+ * available.
+ */
+int sha1_multi_lanes(void)
+{
+  if (sha1_blocks != sha1_blocks_generic || sha1_multi_blocks == NULL)
+    return 1;
+
+  return sha1_multi_lane_count;
+}
+
+/**
+ * sha1_multi:
+ * @num_msgs: Number of independent messages
+ * @addr: Pointers to the messages
+ * @len: Lengths of the messages
+ * @mac: Buffer for the hashes (num_msgs * 20 bytes)
+ *
+ * SHA-1 hash of several independent messages at once
+ */
+void sha1_multi(size_t num_msgs, const uint8_t *addr[], const size_t *len,
+    uint8_t *mac)
+{
+  SHA1_CTX *contexts = NULL;
+  SHA1MultiJob *jobs = NULL;
+  size_t i;
+
+  if (sha1_multi_lanes() > 1) {
+    contexts = malloc(num_msgs * sizeof(SHA1_CTX));
+    jobs = malloc(num_msgs * sizeof(SHA1MultiJob));
+  }
+
+  if (contexts == NULL || jobs == NULL) {
+    SHA1_CTX ctx;
+
+    for (i = 0; i < num_msgs; i++) {
+      SHA1Init(&ctx);
+      SHA1Update64(&ctx, addr[i], len[i]);
+      SHA1Final(mac + i * SHA1_MAC_LEN, &ctx);
+    }
+    goto done;
+  }
+
+  for (i = 0; i < num_msgs; i++) {
+    SHA1Init(&contexts[i]);
+    jobs[i].context = &contexts[i];
+    jobs[i].data = addr[i];
+    jobs[i].len = len[i];
+  }
+  sha1_multi_update(jobs, num_msgs);
+  for (i = 0; i < num_msgs; i++)
+    SHA1Final(mac + i * SHA1_MAC_LEN, &contexts[i]);
+
+ done:
+  free(contexts);
+  free(jobs);
+}
+
+/**
+ * hmac_sha1_multi_keyed:
+ * @key: Precomputed HMAC key, see HMACKeyInit()
+ * @num_msgs: Number of independent messages
+ * @addr: Pointers to the messages
+ * @len: Lengths of the messages
+ * @mac: Buffer for the hashes (num_msgs * 20 bytes)
+ *
+ * HMAC-SHA1 of several independent messages at once, using the same key
+ */
+void hmac_sha1_multi_keyed(const HMAC_KEY *key, size_t num_msgs,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  HMAC_CTX *contexts;
+  SHA1MultiJob *jobs = NULL;
+  size_t i;
+
+  contexts = malloc(num_msgs * sizeof(HMAC_CTX));
+  if (contexts && sha1_multi_lanes() > 1)
+    jobs = malloc(num_msgs * sizeof(SHA1MultiJob));
+
+  if (contexts == NULL || jobs == NULL) {
+    HMAC_CTX ctx;
+
+    for (i = 0; i < num_msgs; i++) {
+      HMACInitKeyed(&ctx, key);
+      SHA1Update64(&ctx.context, addr[i], len[i]);
+      HMACFinal(mac + i * SHA1_MAC_LEN, &ctx);
+    }
+    goto done;
+  }
+
+  for (i = 0; i < num_msgs; i++) {
+    HMACInitKeyed(&contexts[i], key);
+    jobs[i].context = &contexts[i].context;
+    jobs[i].data = addr[i];
+    jobs[i].len = len[i];
+  }
+  sha1_multi_update(jobs, num_msgs);
+  for (i = 0; i < num_msgs; i++)
+    HMACFinal(mac + i * SHA1_MAC_LEN, &contexts[i]);
+
+ done:
+  free(contexts);
+  free(jobs);
+}
+
+/**
+ * hmac_sha1_multi:
+ * @key: Key for HMAC operations
+ * @key_len: Length of the key in bytes
+ * @num_msgs: Number of independent messages
+ * @addr: Pointers to the messages
+ * @len: Lengths of the messages
+ * @mac: Buffer for the hashes (num_msgs * 20 bytes)
+ *
+ * HMAC-SHA1 of several independent messages at once, using the same key
+ */
+void hmac_sha1_multi(const uint8_t *key, size_t key_len, size_t num_msgs,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  HMAC_KEY hmac_key;
+
+  HMACKeyInit(&hmac_key, key, key_len);
+  hmac_sha1_multi_keyed(&hmac_key, num_msgs, addr, len, mac);
+  memset(&hmac_key, 0, sizeof(hmac_key));
+}
@@ -30,23 +30,41 @@ typedef struct SHA1Context SHA1_CTX;
 
 void SHA1Init(SHA1_CTX *context);
 void SHA1Update(SHA1_CTX *context, const void *data, uint32_t len);
+void SHA1Update64(SHA1_CTX *context, const void *data, uint64_t len);
 void SHA1Final(unsigned char digest[20], SHA1_CTX *context);
+const char *SHA1Implementation(void);
+
+/* SHA-1 states after hashing the ipad and opad blocks of a key */
+struct HMACKey {
+  uint32_t inner[5];
+  uint32_t outer[5];
+};
+typedef struct HMACKey HMAC_KEY;
 
 struct HMACContext {
   SHA1_CTX context;
-  uint8_t key[64];
-  size_t key_len;
+  uint32_t outer[5];
 };
 typedef struct HMACContext HMAC_CTX;
 
+void HMACKeyInit(HMAC_KEY *hmac_key, const uint8_t *key, size_t key_len);
+void HMACInitKeyed(HMAC_CTX *context, const HMAC_KEY *key);
 void HMACInit(HMAC_CTX *context, const uint8_t *key, size_t key_len);
 void HMACUpdate(HMAC_CTX *context, const void *data, uint32_t len);
+void HMACUpdate64(HMAC_CTX *context, const void *data, uint64_t len);
 void HMACFinal(unsigned char digest[20], HMAC_CTX *context);
 
 void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
     uint8_t *mac);
 void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
     const uint8_t *addr[], const size_t *len, uint8_t *mac);
+int sha1_multi_lanes(void);
+void sha1_multi(size_t num_msgs, const uint8_t *addr[], const size_t *len,
+    uint8_t *mac);
+void hmac_sha1_multi(const uint8_t *key, size_t key_len, size_t num_msgs,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac);
+void hmac_sha1_multi_keyed(const HMAC_KEY *key, size_t num_msgs,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac);
 void hmac_sha1(const uint8_t *key, size_t key_len,
     const uint8_t *data, size_t data_len, uint8_t *mac);
 void sha1_prf(const uint8_t *key, size_t key_len, const char *label,
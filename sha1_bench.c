@@ -0,0 +1,159 @@
+/*
+ * sha1_bench.c -- SHA-1/HMAC throughput benchmark
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1.h"
+
+#define MULTI_MESSAGES 16
+#define SMALL_MESSAGE 256
+
+static const uint8_t bench_key[64] = "PS3Utils benchmark key";
+
+static double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One tab separated line per result, same columns as bench.sh */
+static void report (const char *name, uint64_t bytes, double elapsed)
+{
+  printf ("%s\t%llu\t%.6f\t%.1f\t%s\n", name, (unsigned long long) bytes,
+      elapsed, elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0,
+      SHA1Implementation ());
+}
+
+/* SHA1Update() in chunks of `chunk` bytes, which for 64 byte multiples
+ * measures the block function itself */
+static void bench_sha1 (const char *name, const uint8_t *data, size_t size,
+    size_t chunk)
+{
+  SHA1_CTX context;
+  uint8_t digest[SHA1_MAC_LEN];
+  size_t i;
+  double start = now ();
+
+  SHA1Init (&context);
+  for (i = 0; i + chunk <= size; i += chunk)
+    SHA1Update (&context, data + i, chunk);
+  SHA1Final (digest, &context);
+
+  report (name, size - size % chunk, now () - start);
+}
+
+static void bench_hmac (const char *name, const uint8_t *data, size_t size,
+    size_t chunk)
+{
+  HMAC_KEY key;
+  HMAC_CTX context;
+  uint8_t digest[SHA1_MAC_LEN];
+  size_t i;
+  double start = now ();
+
+  HMACKeyInit (&key, bench_key, sizeof(bench_key));
+  HMACInitKeyed (&context, &key);
+  for (i = 0; i + chunk <= size; i += chunk)
+    HMACUpdate (&context, data + i, chunk);
+  HMACFinal (digest, &context);
+
+  report (name, size - size % chunk, now () - start);
+}
+
+/* Many small messages, where the per-message key setup dominates */
+static void bench_hmac_small (const uint8_t *data, size_t size)
+{
+  HMAC_KEY key;
+  HMAC_CTX context;
+  uint8_t digest[SHA1_MAC_LEN];
+  size_t i;
+  double start;
+
+  start = now ();
+  for (i = 0; i + SMALL_MESSAGE <= size; i += SMALL_MESSAGE) {
+    HMACInit (&context, bench_key, sizeof(bench_key));
+    HMACUpdate (&context, data + i, SMALL_MESSAGE);
+    HMACFinal (digest, &context);
+  }
+  report ("hmac_small_init", size - size % SMALL_MESSAGE, now () - start);
+
+  start = now ();
+  HMACKeyInit (&key, bench_key, sizeof(bench_key));
+  for (i = 0; i + SMALL_MESSAGE <= size; i += SMALL_MESSAGE) {
+    HMACInitKeyed (&context, &key);
+    HMACUpdate (&context, data + i, SMALL_MESSAGE);
+    HMACFinal (digest, &context);
+  }
+  report ("hmac_small_keyed", size - size % SMALL_MESSAGE, now () - start);
+}
+
+static void bench_hmac_multi (const uint8_t *data, size_t size)
+{
+  const uint8_t *addr[MULTI_MESSAGES];
+  size_t len[MULTI_MESSAGES];
+  uint8_t macs[MULTI_MESSAGES * SHA1_MAC_LEN];
+  char name[64];
+  size_t i;
+  double start;
+
+  for (i = 0; i < MULTI_MESSAGES; i++) {
+    addr[i] = data + i * (size / MULTI_MESSAGES);
+    len[i] = size / MULTI_MESSAGES;
+  }
+
+  start = now ();
+  hmac_sha1_multi (bench_key, sizeof(bench_key), MULTI_MESSAGES, addr, len,
+      macs);
+  snprintf (name, sizeof(name), "hmac_multi_%d_lanes", sha1_multi_lanes ());
+  report (name, len[0] * MULTI_MESSAGES, now () - start);
+}
+
+int main (int argc, char *argv[])
+{
+  uint8_t *data;
+  size_t size = 256;
+  size_t i;
+
+  if (argc > 2) {
+    fprintf (stderr, "Usage: %s [size in MB]\n", argv[0]);
+    return -1;
+  }
+  if (argc == 2)
+    size = strtoul (argv[1], NULL, 0);
+  if (size == 0)
+    size = 1;
+  size *= 1024 * 1024;
+
+  data = malloc (size);
+  if (data == NULL) {
+    perror ("Couldn't allocate the benchmark buffer");
+    return -2;
+  }
+  for (i = 0; i < size; i++)
+    data[i] = i * 2654435761U >> 13;
+
+  bench_sha1 ("sha1_update_64", data, size, 64);
+  bench_sha1 ("sha1_update_1m", data, size, 1024 * 1024);
+  bench_hmac ("hmac_update_1k", data, size, 1024);
+  bench_hmac ("hmac_update_64k", data, size, 64 * 1024);
+  bench_hmac_small (data, size / 16);
+  bench_hmac_multi (data, size);
+
+  free (data);
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * tar.c -- Minimal TAR archive reader
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tar.h"
+
+/* Numeric fields are octal, or base-256 (GNU) when the high bit is set */
+static int parse_number (const char *field, size_t len, uint64_t *value)
+{
+  size_t i;
+
+  *value = 0;
+  if ((unsigned char) field[0] & 0x80) {
+    *value = (unsigned char) field[0] & 0x7f;
+    for (i = 1; i < len; i++)
+      *value = (*value << 8) | (unsigned char) field[i];
+    return 1;
+  }
+
+  for (i = 0; i < len && field[i] == ' '; i++);
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    *value = (*value << 3) | (field[i] - '0');
+
+  return i == len || field[i] == ' ' || field[i] == '\0';
+}
+
+int tar_parse_header (const uint8_t block[TAR_BLOCK_SIZE], TARMember *member)
+{
+  const TARHeader *header = (const TARHeader *) block;
+  uint64_t checksum;
+  unsigned int sum = 0;
+  unsigned int i;
+
+  for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+    if (block[i] != 0)
+      break;
+  }
+  if (i == TAR_BLOCK_SIZE)
+    return 0;
+
+  /* The checksum is computed with its own field set to spaces */
+  for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+    if (i >= offsetof (TARHeader, checksum) &&
+        i < offsetof (TARHeader, checksum) + sizeof(header->checksum))
+      sum += ' ';
+    else
+      sum += block[i];
+  }
+  if (!parse_number (header->checksum, sizeof(header->checksum), &checksum) ||
+      checksum != sum)
+    return -1;
+
+  if (!parse_number (header->filesize, sizeof(header->filesize),
+          &member->size))
+    return -1;
+
+  member->type = header->file_type;
+  member->data = NULL;
+
+  /* POSIX ustar splits long names in a prefix and a name, old GNU tar (and
+   * fix_tar) use "ustar  " and don't have that field */
+  if (memcmp (header->ustar, "ustar", 6) == 0 && header->filename_prefix[0])
+    snprintf (member->name, sizeof(member->name), "%.*s/%.*s",
+        (int) sizeof(header->filename_prefix), header->filename_prefix,
+        (int) sizeof(header->filename), header->filename);
+  else
+    snprintf (member->name, sizeof(member->name), "%.*s",
+        (int) sizeof(header->filename), header->filename);
+
+  return 1;
+}
+
+void tar_apply_long_name (const TARMember *header, const uint8_t *data,
+    TARMember *member)
+{
+  const uint8_t *end = data + header->size;
+  const uint8_t *record;
+  const uint8_t *value;
+  uint64_t len;
+  size_t size;
+
+  if (header->type == 'L') {
+    size = header->size;
+    if (size > sizeof(member->name) - 1)
+      size = sizeof(member->name) - 1;
+    memcpy (member->name, data, size);
+    member->name[size] = '\0';
+    return;
+  }
+
+  /* pax records are "<length> <keyword>=<value>\n" */
+  for (record = data; record < end; record += len) {
+    len = 0;
+    for (value = record; value < end && *value >= '0' && *value <= '9';
+         value++)
+      len = len * 10 + (*value - '0');
+    if (len == 0 || len > (uint64_t) (end - record) || value == end ||
+        *value != ' ')
+      return;
+    value++;
+
+    size = record + len - value;
+    if (size > 6 && memcmp (value, "path=", 5) == 0 &&
+        value[size - 1] == '\n') {
+      size -= 6;
+      if (size > sizeof(member->name) - 1)
+        size = sizeof(member->name) - 1;
+      memcpy (member->name, value + 5, size);
+      member->name[size] = '\0';
+    }
+  }
+}
+
+void tar_reader_init (TARReader *reader, const uint8_t *data, uint64_t size)
+{
+  reader->data = data;
+  reader->size = size;
+  reader->offset = 0;
+}
+
+int tar_reader_next (TARReader *reader, TARMember *member)
+{
+  TARMember long_name;
+  int have_long_name = 0;
+  int ret;
+
+  while (1) {
+    if (reader->size - reader->offset < TAR_BLOCK_SIZE)
+      return reader->offset == reader->size ? 0 : -1;
+
+    ret = tar_parse_header (reader->data + reader->offset, member);
+    if (ret <= 0)
+      return ret;
+    reader->offset += TAR_BLOCK_SIZE;
+
+    if (member->size > reader->size - reader->offset)
+      return -1;
+    member->data = reader->data + reader->offset;
+    reader->offset += member->size;
+    reader->offset += TAR_PADDED_SIZE (member->size) - member->size;
+    if (reader->offset > reader->size)
+      reader->offset = reader->size;
+
+    if (member->type == 'L' || member->type == 'x') {
+      long_name = *member;
+      have_long_name = 1;
+      continue;
+    }
+    if (have_long_name) {
+      tar_apply_long_name (&long_name, long_name.data, member);
+      have_long_name = 0;
+    }
+
+    if (member->type == '0' || member->type == '\0' || member->type == '7' ||
+        member->type == '5')
+      return 1;
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ * tar.h -- Minimal TAR archive reader
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#define TAR_BLOCK_SIZE 512
+
+/* Size of a member's data once padded to the block size */
+#define TAR_PADDED_SIZE(size) \
+  (((size) + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE)
+
+typedef struct {
+  char filename[100];
+  char filemode[8];
+  char owner_id[8];
+  char group_id[8];
+  char filesize[12];
+  char atime[12];
+  char checksum[8];
+  char file_type;
+  char link[100];
+  char ustar[6];
+  char ustar_version[2];
+  char owner[32];
+  char group[32];
+  char device_major[8];
+  char device_minor[8];
+  char filename_prefix[155];
+  char padding[12];
+} TARHeader;
+
+typedef struct {
+  char name[PATH_MAX + 1];
+  uint64_t size;
+  char type;
+  /* Only set by tar_reader_next () */
+  const uint8_t *data;
+} TARMember;
+
+/* Parses a header block. Returns 1 for a member, 0 for the zero block that
+ * ends the archive and -1 if the block isn't a valid header. GNU long names
+ * and pax headers show up as members of type 'L' and 'x', which
+ * tar_reader_next () takes care of. */
+int tar_parse_header (const uint8_t block[TAR_BLOCK_SIZE], TARMember *member);
+
+/* Applies the path of a pax extended header, or a GNU long name, found in
+ * the data of the previous member, to member */
+void tar_apply_long_name (const TARMember *header, const uint8_t *data,
+    TARMember *member);
+
+/* Iterates over the members of an archive that is in memory */
+typedef struct {
+  const uint8_t *data;
+  uint64_t size;
+  uint64_t offset;
+} TARReader;
+
+void tar_reader_init (TARReader *reader, const uint8_t *data, uint64_t size);
+
+/* Returns 1 and fills in member, 0 at the end of the archive, -1 if the
+ * archive is truncated or corrupted. Only regular files and directories are
+ * returned, all the other members are skipped. */
+int tar_reader_next (TARReader *reader, TARMember *member);
+
+#endif /* TAR_H */
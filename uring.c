@@ -0,0 +1,351 @@
+/*
+ * uring.c -- Pipelined file copies with io_uring
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+/* The ring is driven with the raw system calls, liburing isn't needed */
+
+typedef enum {
+  CHUNK_FREE,
+  CHUNK_READING,
+  CHUNK_READ,
+  CHUNK_WRITING
+} ChunkState;
+
+typedef struct {
+  uint8_t *buffer;
+  ChunkState state;
+  uint64_t offset;
+  size_t len;
+  size_t done;
+} Chunk;
+
+struct URing {
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int to_submit;
+  unsigned int in_flight;
+  unsigned int depth;
+  size_t chunk_size;
+  Chunk *chunks;
+};
+
+URing *uring_new (unsigned int depth, size_t chunk_size)
+{
+  const char *io = getenv ("PS3UTILS_IO");
+  struct io_uring_params params;
+  URing *ring;
+  uint8_t *sq;
+  uint8_t *cq;
+  unsigned int i;
+
+  if (io == NULL || strcmp (io, "uring") != 0)
+    return NULL;
+
+  ring = calloc (1, sizeof(URing));
+  if (ring == NULL)
+    return NULL;
+  ring->fd = -1;
+  ring->depth = depth;
+  ring->chunk_size = chunk_size;
+
+  ring->chunks = calloc (depth, sizeof(Chunk));
+  if (ring->chunks == NULL)
+    goto error;
+  for (i = 0; i < depth; i++) {
+    if (posix_memalign ((void **) &ring->chunks[i].buffer,
+            sysconf (_SC_PAGESIZE), chunk_size) != 0)
+      goto error;
+  }
+
+  /* Every chunk has at most one operation in flight */
+  memset (&params, 0, sizeof(params));
+  ring->fd = syscall (__NR_io_uring_setup, depth, &params);
+  if (ring->fd < 0)
+    goto error;
+
+  /* IORING_OP_READ and IORING_OP_WRITE came with the same kernel (5.6) */
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    goto error;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries *
+      sizeof(uint32_t);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries *
+      sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto error;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto error;
+  }
+
+  sq = ring->sq_ring;
+  ring->sq_head = (uint32_t *) (sq + params.sq_off.head);
+  ring->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(uint32_t *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (uint32_t *) (sq + params.sq_off.array);
+
+  cq = ring->cq_ring;
+  ring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+  ring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(uint32_t *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return ring;
+
+ error:
+  uring_free (ring);
+  return NULL;
+}
+
+void uring_free (URing *ring)
+{
+  unsigned int i;
+
+  if (ring == NULL)
+    return;
+
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  if (ring->chunks) {
+    for (i = 0; i < ring->depth; i++)
+      free (ring->chunks[i].buffer);
+  }
+  free (ring->chunks);
+  free (ring);
+}
+
+/* Queues the rest of a chunk's read or write, it's only submitted by the
+ * next uring_enter () */
+static void queue_chunk (URing *ring, unsigned int index, int fd,
+    uint64_t offset)
+{
+  Chunk *chunk = &ring->chunks[index];
+  uint32_t tail = *ring->sq_tail;
+  struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+  memset (sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = chunk->state == CHUNK_READING ?
+      IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = offset + chunk->offset + chunk->done;
+  sqe->addr = (uintptr_t) (chunk->buffer + chunk->done);
+  sqe->len = chunk->len - chunk->done;
+  sqe->user_data = index;
+
+  ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  ring->in_flight++;
+}
+
+static int uring_enter (URing *ring, unsigned int wait)
+{
+  int ret;
+
+  do {
+    ret = syscall (__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return 0;
+
+  ring->to_submit -= ret;
+
+  return 1;
+}
+
+/* Takes back what the kernel refused, so the ring can be used again */
+static void uring_unqueue (URing *ring)
+{
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail - ring->to_submit,
+      __ATOMIC_RELEASE);
+  ring->in_flight -= ring->to_submit;
+  ring->to_submit = 0;
+}
+
+int uring_copy (URing *ring, int in_fd, uint64_t in_offset, int out_fd,
+    uint64_t out_offset, uint64_t len,
+    void (*process) (void *data, const uint8_t *chunk, size_t len),
+    void *data)
+{
+  uint64_t count = (len + ring->chunk_size - 1) / ring->chunk_size;
+  uint64_t next_read = 0;
+  uint64_t next_process = 0;
+  struct io_uring_cqe *cqe;
+  Chunk *chunk;
+  uint32_t head;
+  unsigned int index;
+  int error = URING_OK;
+  int error_errno = 0;
+
+  while (next_process < count || ring->in_flight > 0) {
+    /* Keep every free buffer busy reading ahead */
+    while (error == URING_OK && next_read < count &&
+        ring->chunks[next_read % ring->depth].state == CHUNK_FREE) {
+      index = next_read % ring->depth;
+      chunk = &ring->chunks[index];
+      chunk->state = CHUNK_READING;
+      chunk->offset = next_read * ring->chunk_size;
+      chunk->len = len - chunk->offset < ring->chunk_size ?
+          len - chunk->offset : ring->chunk_size;
+      chunk->done = 0;
+      queue_chunk (ring, index, in_fd, in_offset);
+      next_read++;
+    }
+    if (ring->to_submit > 0 && !uring_enter (ring, 0)) {
+      if (error == URING_OK) {
+        error = URING_ERROR_READ;
+        error_errno = errno;
+      }
+      uring_unqueue (ring);
+    }
+
+    /* Chunks are processed in order while the kernel works on the others */
+    chunk = &ring->chunks[next_process % ring->depth];
+    if (error == URING_OK && next_process < count &&
+        chunk->state == CHUNK_READ) {
+      process (data, chunk->buffer, chunk->len);
+      if (out_fd >= 0) {
+        chunk->state = CHUNK_WRITING;
+        chunk->done = 0;
+        queue_chunk (ring, next_process % ring->depth, out_fd, out_offset);
+      } else {
+        chunk->state = CHUNK_FREE;
+      }
+      next_process++;
+      continue;
+    }
+
+    if (ring->in_flight == 0)
+      break;
+    if (!uring_enter (ring, 1)) {
+      /* Nothing can be reaped, so nothing is still being worked on */
+      if (error == URING_OK) {
+        error = URING_ERROR_READ;
+        error_errno = errno;
+      }
+      break;
+    }
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & ring->cq_mask];
+      chunk = &ring->chunks[cqe->user_data];
+      ring->in_flight--;
+
+      if (cqe->res <= 0) {
+        if (error == URING_OK) {
+          error = chunk->state == CHUNK_READING ?
+              URING_ERROR_READ : URING_ERROR_WRITE;
+          error_errno = cqe->res < 0 ? -cqe->res : EIO;
+        }
+        chunk->state = CHUNK_FREE;
+      } else {
+        chunk->done += cqe->res;
+        if (chunk->done < chunk->len && error == URING_OK)
+          queue_chunk (ring, cqe->user_data,
+              chunk->state == CHUNK_READING ? in_fd : out_fd,
+              chunk->state == CHUNK_READING ? in_offset : out_offset);
+        else if (chunk->state == CHUNK_READING && error == URING_OK)
+          chunk->state = CHUNK_READ;
+        else
+          chunk->state = CHUNK_FREE;
+      }
+      head++;
+    }
+    __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  for (index = 0; index < ring->depth; index++)
+    ring->chunks[index].state = CHUNK_FREE;
+
+  errno = error_errno;
+
+  return error;
+}
+
+#else
+
+URing *uring_new (unsigned int depth, size_t chunk_size)
+{
+  return NULL;
+}
+
+void uring_free (URing *ring)
+{
+}
+
+int uring_copy (URing *ring, int in_fd, uint64_t in_offset, int out_fd,
+    uint64_t out_offset, uint64_t len,
+    void (*process) (void *data, const uint8_t *chunk, size_t len),
+    void *data)
+{
+  errno = ENOSYS;
+  return URING_ERROR_READ;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * uring.h -- Pipelined file copies with io_uring
+ *
+ * Copyright (C) Youness Alaoui (KaKaRoTo)
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum {
+  URING_OK = 0,
+  URING_ERROR_READ = -1,
+  URING_ERROR_WRITE = -2
+};
+
+typedef struct URing URing;
+
+/* Returns NULL, and the caller should use plain read () and write (), if
+ * io_uring wasn't asked for with PS3UTILS_IO=uring in the environment or
+ * if the kernel doesn't support it. The ring owns `depth` buffers of
+ * chunk_size bytes, aligned to the page size. A ring must only be used by
+ * one thread at a time. */
+URing *uring_new (unsigned int depth, size_t chunk_size);
+void uring_free (URing *ring);
+
+/* Copies len bytes from in_fd at in_offset to out_fd at out_offset, or
+ * only reads them if out_fd is -1, and hands every chunk to process () in
+ * order. The read of the next chunks and the write of the previous ones are
+ * in flight while process () runs. On error, errno is set and nothing is
+ * left in flight. */
+int uring_copy (URing *ring, int in_fd, uint64_t in_offset, int out_fd,
+    uint64_t out_offset, uint64_t len,
+    void (*process) (void *data, const uint8_t *chunk, size_t len),
+    void *data);
+
+#endif /* URING_H */